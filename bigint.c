@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bigint.h"
+
+#define SMALL_LIMBS 2 //a long takes at most that many limbs
+
+/* Big with room for a long, so that small operands need no allocation */
+typedef struct {
+  Big b;
+  uint32_t limb[SMALL_LIMBS];
+} SmallBig;
+
+static Big *big_alloc(uint32_t len) {
+  Big *b = malloc(sizeof(*b) + sizeof(b->limb[0]) * len);
+  if (b != NULL) {
+    b->len = len;
+    b->neg = 0;
+  }
+  return b;
+}
+
+/* Big form of [a], borrowed from [a] itself or written to [s] */
+static const Big *view(Num a, SmallBig *s) {
+  if (a.big != NULL)
+    return a.big;
+  //magnitude of the most negative long does not fit into a long, but it does fit unsigned
+  unsigned long m = (a.val < 0) ? -(unsigned long) a.val : (unsigned long) a.val;
+  s->b.neg = (a.val < 0);
+  s->b.len = 0;
+  for (; m != 0; m >>= 32)
+    s->b.limb[s->b.len++] = (uint32_t) m;
+  return &s->b;
+}
+
+/* Drops leading zero limbs of [b] and stores it in [r], as a long if it fits there */
+static int finish(Big *b, Num *r) {
+  while (b->len > 0 && b->limb[b->len - 1] == 0)
+    b->len--;
+  if (b->len <= SMALL_LIMBS) {
+    unsigned long m = 0;
+    for (uint32_t j=b->len; j>0; j--)
+      m = m << 32 | b->limb[j-1];
+    if (m <= (unsigned long) INT64_MAX || (b->neg && m == (unsigned long) INT64_MAX + 1)) {
+      r->val = b->neg ? (long) -m : (long) m;
+      r->big = NULL;
+      free(b);
+      return 0;
+    }
+  }
+  r->val = 0;
+  r->big = b;
+  return 0;
+}
+
+static int cmp_mag(const Big *a, const Big *b) {
+  if (a->len != b->len)
+    return (a->len < b->len) ? -1 : 1;
+  for (uint32_t j=a->len; j>0; j--) {
+    if (a->limb[j-1] != b->limb[j-1])
+      return (a->limb[j-1] < b->limb[j-1]) ? -1 : 1;
+  }
+  return 0;
+}
+
+int num_add_big(Num na, Num nb, Num *r) {
+  SmallBig sa, sb;
+  const Big *a = view(na, &sa), *b = view(nb, &sb);
+  if (cmp_mag(a, b) < 0) { //the larger magnitude goes first, it gives the sign
+    const Big *t = a;
+    a = b;
+    b = t;
+  }
+  Big *s = big_alloc(a->len + 1);
+  if (s == NULL)
+    return -1;
+  s->neg = a->neg;
+  int64_t carry = 0; //or borrow, when signs differ
+  for (uint32_t j=0; j<a->len; j++) {
+    uint32_t bj = (j < b->len) ? b->limb[j] : 0;
+    carry += (int64_t) a->limb[j] + ((a->neg == b->neg) ? bj : -(int64_t) bj);
+    s->limb[j] = (uint32_t) carry;
+    carry >>= 32; //arithmetic shift keeps the borrow at -1
+  }
+  s->limb[a->len] = (uint32_t) carry;
+  return finish(s, r);
+}
+
+int num_mul_big(Num na, Num nb, Num *r) {
+  SmallBig sa, sb;
+  const Big *a = view(na, &sa), *b = view(nb, &sb);
+  Big *p = big_alloc(a->len + b->len);
+  if (p == NULL)
+    return -1;
+  memset(p->limb, 0, sizeof(p->limb[0]) * p->len);
+  for (uint32_t j=0; j<a->len; j++) {
+    uint64_t carry = 0;
+    for (uint32_t k=0; k<b->len; k++) {
+      carry += (uint64_t) a->limb[j] * b->limb[k] + p->limb[j+k];
+      p->limb[j+k] = (uint32_t) carry;
+      carry >>= 32;
+    }
+    p->limb[j + b->len] = (uint32_t) carry;
+  }
+  p->neg = (a->neg != b->neg);
+  return finish(p, r);
+}
+
+int num_neg_big(Num na, Num *r) {
+  SmallBig sa;
+  const Big *a = view(na, &sa);
+  Big *n = big_alloc(a->len);
+  if (n == NULL)
+    return -1;
+  memcpy(n->limb, a->limb, sizeof(a->limb[0]) * a->len);
+  n->neg = !a->neg;
+  return finish(n, r);
+}
+
+int num_copy(Num a, Num *r) {
+  *r = a;
+  if (a.big != NULL) {
+    if ((r->big = malloc(big_size(a.big))) == NULL)
+      return -1;
+    memcpy(r->big, a.big, big_size(a.big));
+  }
+  return 0;
+}
+
+/* Prints digits in chunks of nine, taken off the magnitude from the least significant one */
+int num_print(FILE *f, Num a) {
+  if (a.big == NULL)
+    return fprintf(f, "%ld", a.val);
+  uint32_t len = a.big->len;
+  uint32_t *mag = malloc(sizeof(*mag) * len);
+  uint32_t *chunks = malloc(sizeof(*chunks) * (len * 10 / 9 + 2)); //10^9 < 2^32 < 10^(9*10/9)
+  if (mag == NULL || chunks == NULL) {
+    free(mag);
+    free(chunks);
+    return -1;
+  }
+  memcpy(mag, a.big->limb, sizeof(*mag) * len);
+  size_t n = 0;
+  while (len > 0) {
+    uint64_t rem = 0;
+    for (uint32_t j=len; j>0; j--) {
+      rem = rem << 32 | mag[j-1];
+      mag[j-1] = (uint32_t) (rem / 1000000000);
+      rem %= 1000000000;
+    }
+    chunks[n++] = (uint32_t) rem;
+    while (len > 0 && mag[len-1] == 0)
+      len--;
+  }
+  int ret = fprintf(f, "%s%u", a.big->neg ? "-" : "", chunks[n-1]);
+  for (size_t j=n-1; j>0 && ret >= 0; j--)
+    ret = fprintf(f, "%09u", chunks[j-1]);
+  free(mag);
+  free(chunks);
+  return ret;
+}
+
+Big *big_decode(const char *buf, size_t len) {
+  Big head;
+  if (len < sizeof(head))
+    return NULL;
+  memcpy(&head, buf, sizeof(head));
+  if (big_size(&head) != len)
+    return NULL;
+  Big *b = malloc(len);
+  if (b != NULL)
+    memcpy(b, buf, len);
+  return b;
+}
@@ -0,0 +1,73 @@
+#ifndef _BIGINT_
+#define _BIGINT_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* Integer of any size, sign and magnitude in 32-bit limbs. Its bytes are also the way it
+   travels between processes. */
+typedef struct {
+  uint32_t len; //limbs in use, the last one is not 0
+  uint32_t neg;
+  uint32_t limb[]; //least significant first
+} Big;
+
+/* Value which is [val] until it does not fit into a long, then it is [big] */
+typedef struct {
+  long val;
+  Big *big;
+} Num;
+
+/* Slow paths of the operations below, results are demoted to val when they fit */
+extern int num_add_big(Num a, Num b, Num *r);
+extern int num_mul_big(Num a, Num b, Num *r);
+extern int num_neg_big(Num a, Num *r);
+
+/* Operations store in [r] a result which owns its big if it has one, arguments are left to
+   the caller. They stay on longs until those overflow and return -1 if memory ran out. */
+static inline int num_add(Num a, Num b, Num *r) {
+  if (a.big == NULL && b.big == NULL && !__builtin_add_overflow(a.val, b.val, &r->val)) {
+    r->big = NULL;
+    return 0;
+  }
+  return num_add_big(a, b, r);
+}
+
+static inline int num_mul(Num a, Num b, Num *r) {
+  if (a.big == NULL && b.big == NULL && !__builtin_mul_overflow(a.val, b.val, &r->val)) {
+    r->big = NULL;
+    return 0;
+  }
+  return num_mul_big(a, b, r);
+}
+
+static inline int num_neg(Num a, Num *r) {
+  if (a.big == NULL && a.val != INT64_MIN) {
+    *r = (Num) {-a.val, NULL};
+    return 0;
+  }
+  return num_neg_big(a, r);
+}
+
+/* Copy of [a] that owns its own big */
+extern int num_copy(Num a, Num *r);
+
+extern int num_print(FILE *f, Num a);
+
+/* Bytes [b] takes on the wire */
+static inline size_t big_size(const Big *b) {
+  return sizeof(*b) + sizeof(b->limb[0]) * b->len;
+}
+
+static inline bool num_equal(Num a, Num b) {
+  if (a.big == NULL || b.big == NULL) //results are demoted, so a big one never equals a long
+    return a.big == b.big && a.val == b.val;
+  return big_size(a.big) == big_size(b.big) && memcmp(a.big, b.big, big_size(a.big)) == 0;
+}
+
+/* Makes a value of [len] bytes received at [buf], NULL if they are not a big value */
+extern Big *big_decode(const char *buf, size_t len);
+
+#endif
@@ -1,12 +1,28 @@
 #include <stdio.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <poll.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#define listen socket_listen //listen() of the nodes is not the socket one
+#include <sys/socket.h>
+#undef listen
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "err.h"
+#include "input.h"
+#include "trace.h"
+#include "bigint.h"
 
 /* Types and structures to represent circuit */
 typedef enum NodeType {
@@ -15,27 +31,29 @@ typedef enum NodeType {
 
 typedef union {
     int var;
+    long num; //numerals may grow when constants are folded
     char op;
 } Label;
 
-typedef struct Node {
-  NodeType type;
-  Label label;
-  struct Node *left, *right;
-  bool is_root; //of some parse tree
-  int id; //unqiue of registered nodes
-  bool visited;
-  int post; //in some topological order
+/* Pipes between top node and one of its clients: var leaf labeled with top's variable
+   or parent of the shared node */
+typedef struct {
+  struct Node *client; //node on the other end
+  int root_write_to_var; //top uses them to message the client
+  int root_read_from_var;
+  int var_write_to_root; //client uses them to message top
+  int var_read_from_root;
+} ClientPipes;
+
+/* Descriptors of a node, only processes need them so they live in a side table */
+typedef struct NodeIO {
   //pipes fall into two different categories: propagated and not, the first need to be opened
   //when creating processes tree, because need to be propagated down it to make connection
   //between 1. descendants (root x and leaves labaleed with x), 2.circuit and leaves labelled with x
   //the second category comprises pipes parallel to process tree edges, close them as soon as possbile
-  /* propagated pipes - these are stored only in root nodes, var leaf knows index in corresponidng array */
-  int *root_write_to_var; //root nodes use them to message var leaves
-  int *root_read_from_var;
-  int *var_write_to_root; //var leaves use them to message root
-  int *var_read_from_root;
-  bool *root_pending_vars;
+  /* propagated pipes - these are stored only in top nodes (roots and nodes with many parents),
+     var leaf knows index in clients array, parent of shared node knows its descriptors */
+  ClientPipes *clients;
   //if node is a leaf labeled with variable it is the index in array of pipes in corresponding tree
   //if there is such a tree of course
   int pipe_id;
@@ -51,60 +69,522 @@ typedef struct Node {
   int parent_write_to_me;
   int read_from_parent;
   int write_to_parent;
+  //operator's ends of pipes to right (0) and left (1) child, whether it is shared or not
+  int write_to_child[2];
+  int read_from_child[2];
+  bool collapsed; //evaluated by the unit of its parent, only with --max-procs
+  int unit; //of which the node is the top, -1 if it has none, only with --max-procs
+  int slot; //of shared node in the code of the unit being compiled, -1 if it is not there yet
+  bool needed; //x[0] depends on it, nodes that are not get neither processes nor pipes
+} NodeIO;
+
+/* Only what parsing, sorting and evaluation touch, descriptors are kept aside */
+typedef struct Node {
+  struct Node *left, *right;
+  Label label;
+  NodeIO *io; //set when processes are about to be spawned
+  NodeType type;
+  int parents; //subtrees are shared between equations, so node may have many parents
+  int slot; //in-process engine keeps value of shared node in this slot, -1 until compiled
+  int id; //unqiue of registered nodes, also position in the side table of descriptors
+  int post; //position in topo_ord if node is a root
+  bool is_root; //of some parse tree
+  bool visited;
 } *ParseTree;
 
+/* Nodes are carved out of chunks, dropped ones wait on a list for reuse */
+#define NODE_CHUNK 1024
+
+typedef struct NodeChunk {
+  struct NodeChunk *next;
+  size_t used;
+  struct Node nodes[NODE_CHUNK];
+} NodeChunk;
+
+/* Explicit stack of tree walks, equations may be nested far deeper than the call stack allows */
+typedef struct {
+  ParseTree node;
+  ParseTree *link; //where the node that takes its place goes
+  int state; //children already walked
+  int depth; //of the left child, compilation only
+} WalkFrame;
+
+typedef struct {
+  WalkFrame *frames;
+  size_t len;
+  size_t cap;
+} WalkStack;
+
+typedef struct {
+  int *list;
+  size_t len;
+  size_t cap;
+} IntList;
+
+/* Open addressing hash map from variable index to its entry in var_table */
+typedef struct {
+  int *keys; //-1 marks an empty cell
+  int *vals;
+  size_t len;
+  size_t cap; //power of two
+} VarMap;
+
+/* Everything circuit knows about the variable that appears in some equation */
+typedef struct {
+  int var;
+  ParseTree tree; //equation of x[var] if there is any
+  //dependency graph of trees, kept to update topo_ord incrementally as equations come
+  IntList deps; //entries of variables referenced in equation of x[var]
+  IntList users; //entries of variables whose equations reference x[var]
+  int seen; //u+1 if x[var] is already on the deps list of entry u
+} VarEntry;
+
 struct Circuit {
   //a list of all the nodes allocated within program, handy in terms of resource management
   ParseTree *variables;
   size_t list_len; //number on nodes in a variables array
   size_t list_cap; //capacity of variables
-  ParseTree *trees; //x[0], .., x[V - 1] varaibles as a roots of trees representing its equations
+  NodeChunk *chunks; //memory of the nodes, the newest chunk first
+  ParseTree free_nodes; //dropped nodes linked with their left pointers
+  NodeIO *io; //descriptors of the nodes indexed with their ids
+  //variables mentioned in equations, only these take memory so indices are not bounded
+  VarEntry *var_table;
+  size_t table_len;
+  size_t table_cap;
+  VarMap var_index; //x[v] -> its entry in var_table
+  //canonical copies of non-root nodes, new subtrees equal to known ones are replaced by them
+  ParseTree *cons;
+  size_t cons_len;
+  size_t cons_cap; //power of two
+  //nodes forked by circuit: roots of equations and nodes shared by many parents
+  ParseTree *tops;
+  size_t tops_len;
   int *topo_ord; //topo_ord[topo_ord_len -1, .., 0] gives a topological ordering of trees
   size_t topo_ord_len;
+  size_t topo_ord_cap;
+  //while equations are read topo_ord has gaps (-1), so that a tree can go right before the
+  //trees using it, trees take slots [topo_lo, topo_hi) until pack_order closes the gaps
+  size_t topo_lo;
+  size_t topo_hi;
 } circuit;
 
 typedef struct {
   int i;
-  long val;
+  int at; //unit or var leaf of the process the message is about, only with --max-procs
+  Num val; //its big is freed with the message unless somebody takes it
   bool err;
 } Mes;
 
-int const NODES_MAX = 1000;
+/* Messages travel as a tag byte, which tells what follows and carries the error flag, then
+   the index as a varint and the value as a zigzag varint, so that small ones take a byte.
+   Queries carry no value at all, big value goes as varint length and the bytes of its Big.
+   With --max-procs the index may be followed by a varint telling what the message is about. */
+enum {
+  TAG_BARE, //value is 0
+  TAG_LONG,
+  TAG_BIG,
+  TAG_ERR = 4,
+  TAG_AT = 8
+};
+
+#define MES_MAX 21 //tag, varints of two ints and of a long
+
+/* In-process evaluation engine. Trees are compiled into one flat array of postfix
+   instructions, laid out in topological order, so that the tree of a variable is always
+   evaluated before any tree containing a leaf labeled with this variable. */
+typedef enum OpCode {
+  OP_NUM, OP_VAR, OP_NEG, OP_ADD, OP_MUL,
+  OP_SAVE, OP_LOAD //value of shared node is computed once and then loaded from its slot
+} OpCode;
+
+typedef struct {
+  OpCode code;
+  int var; //OP_VAR: label of the leaf, OP_SAVE and OP_LOAD: the slot
+  int tree; //OP_VAR: position of x[var] tree in the topological order, -1 if there is none
+  long num; //OP_NUM: the numeral
+} Instr;
+
+struct Program {
+  Instr *code;
+  size_t len;
+  size_t cap;
+  size_t *tree_end; //code of topo_ord[k] tree spans [tree_end[k-1], tree_end[k])
+  size_t depth; //size of evaluation stack sufficient for every tree
+  int slots; //number of shared nodes
+} program;
+
+/* In-process engine evaluates queries in blocks, one lane per query, every operation is
+   applied to all the lanes at once so that compiler can vectorize it */
+#define LANES 64
+
+typedef struct {
+  long val[LANES];
+  uint64_t err; //bit l is set if query of lane l cannot be computed with its init list
+  uint64_t over; //bit l is set if value of lane l overflowed, only with --bigint
+} Lanes;
+
+/* Buffers of evaluation of the program */
+typedef struct {
+  Lanes *trees; //results of trees in topological order
+  Lanes *stack;
+  Lanes *slots; //values of shared nodes
+} EvalState;
+
+/* Init lists in compressed rows: only the assignments that were actually given are kept.
+   Holds one batch of lines, which is all of them unless queries are streamed. */
+struct InitLists {
+  int base; //query sent for line i of the batch is base + i
+  int lines; //read so far
+  int *labels; //numbers of query lines
+  size_t *row; //assignments of query i are at [row[i], row[i+1]) sorted by variable
+  int *var;
+  int *val;
+  size_t len; //of var and val
+  size_t cap;
+} init;
+
 int const INFINITY = 5001;
 
-Mes *message = NULL;
+/* Delta evaluation keeps values of the nodes x[0] depends on from one query to the next.
+   Only var leaves of variables whose assignment changed are recomputed, and the nodes above
+   them as long as their values keep changing, so that a query costs what its change does. */
+struct Delta {
+  ParseTree *order; //nodes x[0] depends on, each one after the ones it is computed from
+  int len;
+  int *pos; //node id -> position in order, -1 if x[0] does not depend on it
+  int *deps; //positions of nodes computed from order[k] are deps[dep_start[k], dep_start[k+1])
+  int *dep_start;
+  int *leaves; //positions of var leaves of entry e of var_table are leaves[leaf_start[e], leaf_start[e+1])
+  int *leaf_start;
+  int vars; //entries of var_table when delta was opened, all var leaves have one
+  Num *val;
+  bool *err;
+  int *cur; //value the last query gave to the variable of each entry, INFINITY if none
+  int *given; //entries of variables the last query gave values to
+  int given_len;
+  int *seen; //the last query that gave a value to the variable of the entry
+  int *heap; //positions waiting to be recomputed, the lowest first
+  int heap_len;
+  bool *queued;
+  int queries;
+} delta;
+
+void delta_free() {
+  for (int k=0; k<delta.len; k++)
+    free(delta.val[k].big);
+  free(delta.order);
+  free(delta.pos);
+  free(delta.deps);
+  free(delta.dep_start);
+  free(delta.leaves);
+  free(delta.leaf_start);
+  free(delta.val);
+  free(delta.err);
+  free(delta.cur);
+  free(delta.given);
+  free(delta.seen);
+  free(delta.heap);
+  free(delta.queued);
+  delta = (struct Delta) {0};
+}
+
+/* Messages are not written one by one, they are gathered in per descriptor buffers
+   and written in batches when the poll loop runs out of work. */
+typedef struct {
+  char *buf;
+  size_t head; //first byte not consumed or not written yet
+  size_t len;
+  size_t cap;
+} MesBuf;
+
+/* Shared memory transport: every channel gets a ring in memory mapped before the forks
+   and its socket pair carries only a doorbell byte when the reader may have gone to sleep,
+   so poll and hangups work as before while messages skip the kernel. Writers never block
+   on a full ring, what does not fit waits in the output batch and the reader rings back
+   through the other direction of the pair once it makes room. */
+#define RING_CAP 8192 //power of two
+
+typedef struct {
+  _Atomic uint32_t head; //bytes consumed
+  _Alignas(64) _Atomic uint32_t tail; //bytes produced
+  _Atomic uint32_t bell; //doorbell byte was written and reader has not noticed it yet
+  _Atomic uint32_t full; //writer has output waiting for room, reader has not rung back yet
+  _Alignas(64) char data[RING_CAP];
+} Ring;
+
+/* Rings of all the processes, taken with atomic bump of [used] also after the forks */
+typedef struct {
+  _Atomic size_t used;
+  size_t cap;
+  size_t size; //of the mapping
+  Ring rings[];
+} RingArena;
+
+RingArena *arena;
+
+struct Mailbox {
+  MesBuf *in; //all indexed with descriptors
+  MesBuf *out;
+  Ring **rings; //of both ends of a pipe or NULL if it carries messages itself
+  int fds; //size of in and out arrays
+  int *dirty; //descriptors with pending output
+  int dirty_len;
+  int epfd; //of the event loop woken when readers make room for pending output, -1 if none
+} mailbox = {.epfd = -1};
+
+size_t const BATCH_CAP = 4096; //pending output of descriptor is flushed once it grows that much
+
+/* Edge triggered epoll over the descriptors a process reads from, each registered with
+   its position in the caller's table of descriptors, which tells who sent the message.
+   Descriptors waiting for room to write come with LOOP_ROOM and are served by the loop. */
+#define LOOP_ROOM (1u << 31)
+
+typedef struct {
+  int epfd;
+  struct epoll_event *events;
+  int cap;
+} EventLoop;
+
+/* What node process knows about the query. Entries live only while the query is in flight,
+   except for the roots, which must remember answers for var leaves that may ask later. */
+typedef struct {
+  int i; //the query, -1 marks an empty slot
+  signed char status; //-1 waiting for the first response, -2 for the second one, 1 F, 2 computed
+  int pending; //responses from children, circuit or root yet to come, units have many inputs
+  Num val;
+  IntList askers; //descriptors' positions in poll table of roots' askers waiting for the answer
+  Num *vals; //values of unit inputs gathered so far, only with --max-procs
+} CacheEntry;
+
+typedef struct {
+  CacheEntry *slots; //open addressing with linear probing
+  size_t len;
+  size_t cap; //power of two
+  size_t vals_len; //of entries' vals, inputs of the unit
+} QueryCache;
+
+/* When the number of processes is bounded nodes are evaluated by units: the equations x[0]
+   depends on and pieces cut off their trees if the budget has room for more processes than
+   there are equations. Members of a unit talk through function calls, a shared one is
+   computed once and loaded from its slot. Only var leaves and pieces below are asked,
+   these are inputs of the unit. Code is postfix, OP_VAR pushes value of an input.
+   Equations share processes when there are more of them than the budget, a piece has one
+   of its own. Every process has one channel to the circuit, which answers var leaves of all
+   its units and asks its equations on their behalf when init list has no value. */
+typedef struct {
+  int var; //label of var leaf, -1 for a piece
+  int at; //var leaf: its number among the leaves of the process, messages about it carry it
+  int write; //piece: this process' ends of pipes to the process of the piece
+  int read;
+} UnitInput;
+
+typedef struct {
+  ParseTree top; //root of equation or of a piece
+  int proc;
+  UnitInput *inputs;
+  size_t inputs_len;
+  size_t inputs_cap;
+  Instr *code;
+  size_t code_len;
+  size_t code_cap;
+  int slots;
+} Unit;
+
+typedef struct {
+  int unit; //first of the process, the others follow
+  int units;
+  int leaves; //var leaves of its units, numbered in a row
+  int read; //process' ends of pipes to the circuit
+  int write;
+  int circuit_read; //circuit's ends
+  int circuit_write;
+  int parent_read; //of piece: ends of pipes to the process of the unit asking it, -1 otherwise
+  int parent_write;
+} UnitProc;
+
+typedef struct {
+  int unit;
+  int input;
+} InputRef;
+
+struct Units {
+  Unit *list; //units of a process are next to each other
+  int len;
+  UnitProc *procs;
+  int procs_len;
+  //what the process evaluating units knows
+  InputRef *leaves; //its var leaves by number
+  InputRef *pieces; //inputs which are pieces by position in the table of descriptors
+  QueryCache *caches;
+  Num *stack;
+  Num *slots;
+} units;
 
 int N, K, V, nr;
+int x0_tree = -1; //topo position of the tree of x[0], -1 if there is none
+IntList verdicts; //labels of equation lines that passed, kept for the snapshot
+uint64_t equations_hash = 14695981039346656037ull; //of the equation lines read, likewise
+
+/* Execution settings chosen on the command line */
+struct Options {
+  bool in_process; //evaluate queries with compiled program instead of the processes tree
+  int threads; //workers of in-process engine
+  bool stream; //read, answer and forget init lists in batches
+  int window; //lines of a batch, bounds queries in flight while streaming
+  int in_flight; //queries the circuit sends to the tree before it waits for answers
+  bool pipes; //send messages through pipes instead of shared memory rings
+  char *snapshot; //load validated circuit from this file instead of parsing equations
+  char *save_snapshot; //write validated circuit to this file
+  int max_procs; //processes evaluating the nodes, which are split into units to fit, 0 for one per node
+  char *trace; //every process appends its counters and events to this file at exit
+  bool bigint; //values grow past longs instead of wrapping around
+  bool delta; //evaluate in-process recomputing only what changed since the previous query
+} options = {false, 1, false, 1024, 1024, false, NULL, NULL, 0, NULL, false, false};
 
 /* Initiates [circuit] structure making allowance for arguments passed by user */
 int init_circuit() {
-  int DEFAULT_BUF_CAP = 2*V;
+  int DEFAULT_BUF_CAP = (V > 8) ? 2*V : 16;
   circuit.variables = (ParseTree *) calloc(DEFAULT_BUF_CAP, sizeof(*circuit.variables));
   if (circuit.variables == NULL)
     return -1;
   circuit.list_cap = DEFAULT_BUF_CAP;
-  circuit.trees = (ParseTree *) calloc(NODES_MAX, sizeof(*circuit.trees));
-  circuit.topo_ord = (int *) calloc(V, sizeof(*circuit.trees));
-  if (circuit.trees == NULL || circuit.topo_ord == NULL)
-    return -1;
   return 0;
 }
 
+/* Snapshot of the validated circuit mapped on startup, the compiled program is used in place */
+struct Snapshot {
+  char *map;
+  size_t size;
+} snapshot;
+
 /* Frees memory storing [circuit] elements and removes all registered nodes. */
 void free_circuit() {
-  for (int i=circuit.list_len-1; i>=0; i--) {
-    if (circuit.variables[i]->root_write_to_var != NULL) {
-      free(circuit.variables[i]->root_write_to_var);
-      free(circuit.variables[i]->root_read_from_var);
-      free(circuit.variables[i]->var_read_from_root);
-      free(circuit.variables[i]->var_write_to_root);
-    }
-    free(circuit.variables[i]);
+  if (snapshot.map != NULL) {
+    munmap(snapshot.map, snapshot.size);
+    snapshot.map = NULL;
+    program.code = NULL;
+    program.tree_end = NULL;
+  }
+  if (circuit.io != NULL) {
+    for (int i=0; i<circuit.list_len; i++)
+      free(circuit.io[i].clients);
   }
+  free(circuit.io);
+  while (circuit.chunks != NULL) {
+    NodeChunk *next = circuit.chunks->next;
+    free(circuit.chunks);
+    circuit.chunks = next;
+  }
+  for (int e=0; e<circuit.table_len; e++) {
+    free(circuit.var_table[e].deps.list);
+    free(circuit.var_table[e].users.list);
+  }
+  free(circuit.var_table);
+  free(circuit.var_index.keys);
+  free(circuit.var_index.vals);
+  free(circuit.cons);
+  free(circuit.tops);
   free(circuit.topo_ord);
-  free(circuit.trees);
   free(circuit.variables);
-  free(message);
+  free(verdicts.list);
+  free(program.code);
+  free(program.tree_end);
+  free(init.labels);
+  free(init.row);
+  free(init.var);
+  free(init.val);
+  for (int fd=0; fd<mailbox.fds; fd++) {
+    free(mailbox.in[fd].buf);
+    free(mailbox.out[fd].buf);
+  }
+  free(mailbox.in);
+  free(mailbox.out);
+  free(mailbox.rings);
+  free(mailbox.dirty);
+  for (int u=0; u<units.len; u++) {
+    free(units.list[u].inputs);
+    free(units.list[u].code);
+  }
+  free(units.list);
+  free(units.procs);
+  free(units.leaves);
+  free(units.pieces);
+  free(units.caches);
+  free(units.stack);
+  free(units.slots);
+  delta_free();
+  if (arena != NULL)
+    munmap(arena, arena->size);
+  input_close();
+}
+
+int varmap_get(VarMap *m, int key) {
+  if (m->cap == 0)
+    return -1;
+  for (size_t h = ((unsigned) key * 2654435761u) & (m->cap - 1); m->keys[h] != -1; h = (h+1) & (m->cap - 1)) {
+    if (m->keys[h] == key)
+      return m->vals[h];
+  }
+  return -1;
+}
+
+int varmap_put(VarMap *m, int key, int val) {
+  if (2*(m->len + 1) > m->cap) {
+    VarMap nm = {0};
+    nm.cap = (m->cap == 0) ? 64 : 2*m->cap;
+    nm.keys = (int *) malloc(sizeof(*nm.keys) * nm.cap);
+    nm.vals = (int *) malloc(sizeof(*nm.vals) * nm.cap);
+    if (nm.keys == NULL || nm.vals == NULL) {
+      free(nm.keys);
+      free(nm.vals);
+      return -1;
+    }
+    memset(nm.keys, -1, sizeof(*nm.keys) * nm.cap);
+    for (size_t h=0; h<m->cap; h++) {
+      if (m->keys[h] != -1)
+        varmap_put(&nm, m->keys[h], m->vals[h]);
+    }
+    free(m->keys);
+    free(m->vals);
+    *m = nm;
+  }
+  size_t h = ((unsigned) key * 2654435761u) & (m->cap - 1);
+  while (m->keys[h] != -1 && m->keys[h] != key)
+    h = (h+1) & (m->cap - 1);
+  if (m->keys[h] == -1)
+    m->len++;
+  m->keys[h] = key;
+  m->vals[h] = val;
+  return 0;
+}
+
+/* Returns index of x[v] in var_table, it's added there if [create] is set.
+   -1 if there is no such entry or it cannot be created */
+int var_entry(int v, bool create) {
+  if (v < 0)
+    return -1;
+  int e = varmap_get(&circuit.var_index, v);
+  if (e >= 0 || !create)
+    return e;
+  if (circuit.table_len == circuit.table_cap) {
+    size_t nsize = (circuit.table_cap == 0) ? 64 : 2*circuit.table_cap;
+    VarEntry *ntable = (VarEntry *) realloc(circuit.var_table, sizeof(*circuit.var_table) * nsize);
+    if (ntable == NULL)
+      return -1;
+    circuit.var_table = ntable;
+    circuit.table_cap = nsize;
+  }
+  e = circuit.table_len;
+  if (varmap_put(&circuit.var_index, v, e) < 0)
+    return -1;
+  circuit.var_table[circuit.table_len++] = (VarEntry) {.var = v};
+  return e;
+}
+
+/* Root of the equation of x[v] or NULL if there is none */
+ParseTree tree_of(int v) {
+  int e = var_entry(v, false);
+  return (e < 0) ? NULL : circuit.var_table[e].tree;
 }
 
 /* Adds [t] to the list of nodes that should be deleted if [free_nodes] is evoked. */
@@ -124,205 +604,551 @@ int register_node(ParseTree t) {
 }
 
 /* Create node of given type and label, it will be registered and thus deleted
-   if [free_nodes] is evoked */
+   if [free_circuit] is evoked */
 ParseTree new_tree(NodeType type, Label label) {
-  ParseTree tree = NULL;
-  tree = (ParseTree) calloc(1, sizeof(*tree));
-  if (tree == NULL)
+  ParseTree tree = circuit.free_nodes;
+  if (tree != NULL) {
+    circuit.free_nodes = tree->left;
+  }
+  else {
+    if (circuit.chunks == NULL || circuit.chunks->used == NODE_CHUNK) {
+      NodeChunk *chunk = (NodeChunk *) malloc(sizeof(*chunk));
+      if (chunk == NULL)
+        return NULL;
+      chunk->next = circuit.chunks;
+      chunk->used = 0;
+      circuit.chunks = chunk;
+    }
+    tree = &circuit.chunks->nodes[circuit.chunks->used++];
+  }
+  *tree = (struct Node) {0};
+  if (register_node(tree) < 0)
     return NULL;
-  register_node(tree);
   tree->label = label;
   tree->type = type;
+  tree->slot = -1;
   return tree;
 }
 
-/* Gets first element of grammar alphabet from line sufix, stores it in [label] and returns
-  the type of the match */
-NodeType retrieve_var(char **line, Label *label) {
-  NodeType type = UNRECOGNIZED_TYPE_ERR;
-  while (**line != '\0' && isspace(**line)) {
-    ++(*line); 
-  }
-  if (**line == 'x' && *(*line + 1) == '[') {
-    *line += 2;
-    int v = atoi(*line);
-    while (**line != '\0' && *((*line)++) != ']');
-    label->var = v;
-    type = VAR;
-  }
-  else if (isdigit(**line)) {
-    int n = atoi(*line);
-    while (isdigit(*(++(*line))));
-    label->var = n;
-    type = PNUM;
-  }
-  else if (**line == '+' || **line == '*') {
-    label->op = **line;
-    type = BINARY; 
-    ++(*line);
-  }
-  else if (**line == '-') {
-    label->op = **line;
-    type = UNARY;
-    ++(*line);
-  }
-  return type;
-}
-
-/*[line] is a sufix which has yet to be procesed
-  [op] and [nop] are tops of stacks that keep respectively opeators and variables/numerals. */
-ParseTree parse_line(char **line, ParseTree op, ParseTree nop) {
-  while (**line != '\0' && (isspace(**line) || **line == '(')) {
-    ++(*line);
-  }
-  // end of currently processed expression, pop the operator and combine it with variable from the top,
-  // if the operator is binary one it will have its left child added in the parent of recursion tree
-  if (**line == ')') { 
-    ++(*line);
-    op->right = nop;
-    return op;
-  }
-  else if (**line != '\0') {
-    Label label;
-    NodeType nodetype;
-    if ((nodetype = retrieve_var(line, &label)) == UNRECOGNIZED_TYPE_ERR) //error
+/* Removes [t] from the list of registered nodes and gives it back for reuse */
+void drop_node(ParseTree t) {
+  ParseTree last = circuit.variables[--circuit.list_len];
+  circuit.variables[t->id] = last;
+  last->id = t->id;
+  t->left = circuit.free_nodes;
+  circuit.free_nodes = t;
+}
+
+/* Roots and nodes with many parents get their own processes forked by circuit,
+   others are forked by their parents */
+bool is_top(ParseTree t) {
+  return t->is_root || t->parents > 1;
+}
+
+size_t node_hash(ParseTree t) {
+  size_t h = t->type;
+  if (t->type == PNUM)
+    h = h*1000003u + (unsigned long) t->label.num;
+  else
+    h = h*1000003u + ((t->type == VAR) ? (unsigned) t->label.var : (unsigned char) t->label.op);
+  h = h*1000003u + (uintptr_t) t->left;
+  h = h*1000003u + (uintptr_t) t->right;
+  return h ^ (h >> 17);
+}
+
+bool same_node(ParseTree a, ParseTree b) {
+  if (a->type != b->type || a->left != b->left || a->right != b->right)
+    return false;
+  if (a->type == PNUM)
+    return a->label.num == b->label.num;
+  return (a->type == VAR) ? a->label.var == b->label.var : a->label.op == b->label.op;
+}
+
+/* Slot of cons table where node equal to [t] is or should be placed */
+ParseTree *cons_slot(ParseTree t) {
+  if (2*(circuit.cons_len + 1) > circuit.cons_cap) {
+    size_t ocap = circuit.cons_cap;
+    ParseTree *old = circuit.cons;
+    circuit.cons_cap = (ocap == 0) ? 256 : 2*ocap;
+    circuit.cons = (ParseTree *) calloc(circuit.cons_cap, sizeof(*circuit.cons));
+    if (circuit.cons == NULL)
       return NULL;
-    ParseTree tree = new_tree(nodetype, label);
-    if (nodetype == PNUM || nodetype == VAR) {
-      // if it's variable or numeral put it on the top of the [nop] stack
-      return parse_line(line, op, tree);
-    }
-    else { //nodetype is either BINARY or UNARY
-      // both types of operators need to be joined with expression that follows them, so put it
-      // on the top of [op] stack
-      ParseTree op_joined_with_var = parse_line(line, tree, NULL);
-      // and binary ones need join with the preceeding expression as well
-      if (nodetype == BINARY)
-        op_joined_with_var->left = nop;
-      // put parsed subtree on the top of [nop] stack
-      return parse_line(line, op, op_joined_with_var);
+    for (size_t h=0; h<ocap; h++) {
+      if (old[h] != NULL)
+        *cons_slot(old[h]) = old[h];
     }
+    free(old);
   }
-  return nop;
+  size_t h = node_hash(t) & (circuit.cons_cap - 1);
+  while (circuit.cons[h] != NULL && !same_node(circuit.cons[h], t))
+    h = (h+1) & (circuit.cons_cap - 1);
+  return &circuit.cons[h];
 }
 
-/*root_id represents variable x[root_id] if tree represent variable or
-  is -1 if its the inner node of some parse tree*/
-int dfs(ParseTree tree, int root_id) {
-  tree->visited = true;
-  if (tree->type == VAR) {
-    int x_i = tree->label.var;
-    ParseTree var_tree = circuit.trees[x_i];
-    if (var_tree != NULL) {
-      if (var_tree->visited) {
-        if (var_tree->post == -1) { // var_tree is a grandparent of mine
-          return -1;
-        }
+/* Computes [*a] [op] [b] into [*a] unless it overflows. Operations that do are left to the
+   evaluation, which gets them right with --bigint and wraps them around the same without it. */
+bool fold_constants(char op, long *a, long b) {
+  long r;
+  if ((op == '+') ? __builtin_add_overflow(*a, b, &r) : __builtin_mul_overflow(*a, b, &r))
+    return false;
+  *a = r;
+  return true;
+}
+
+/* Applies folding rules to [tree] whose subtrees are already simplified. Constant operations
+   are computed, double minus, adding 0 and multiplying by 1 are dropped, and constant operands
+   of chained + or * are gathered into one. Multiplication by 0 is folded only when the other
+   operand is constant too, as a variable missing from init list must still give F. */
+ParseTree fold_node(ParseTree tree) {
+  while (true) { //chains of constants fold from the top
+    if (tree->type == UNARY) {
+      ParseTree r = tree->right;
+      if (r->type == PNUM && r->label.num != LONG_MIN) {
+        r->label.num = -r->label.num;
+        drop_node(tree);
+        return r;
       }
-      else {
-        if (dfs(var_tree, x_i) < 0)
-          return -1;
+      if (r->type == UNARY) {
+        ParseTree x = r->right;
+        drop_node(r);
+        drop_node(tree);
+        return x;
       }
     }
+    else if (tree->type == BINARY) {
+      char op = tree->label.op;
+      if (tree->left->type == PNUM && tree->right->type != PNUM) { //constants go right
+        ParseTree l = tree->left;
+        tree->left = tree->right;
+        tree->right = l;
+      }
+      ParseTree l = tree->left, r = tree->right;
+      if (r->type != PNUM)
+        return tree;
+      if (l->type == PNUM) {
+        if (!fold_constants(op, &l->label.num, r->label.num))
+          return tree;
+        drop_node(r);
+        drop_node(tree);
+        return l;
+      }
+      if (r->label.num == ((op == '+') ? 0 : 1)) {
+        drop_node(r);
+        drop_node(tree);
+        return l;
+      }
+      if (l->type == BINARY && l->label.op == op && l->right->type == PNUM) { //(x op a) op b
+        if (!fold_constants(op, &l->right->label.num, r->label.num))
+          return tree;
+        drop_node(r);
+        drop_node(tree);
+        tree = l;
+        continue;
+      }
+    }
+    return tree;
   }
-  else if (tree->type == UNARY || tree->type == BINARY) {
-    if ((dfs(tree->right, -1) < 0) || (tree->type == BINARY && (dfs(tree->left, -1) < 0)))
+}
+
+int walk_push(WalkStack *st, ParseTree node, ParseTree *link) {
+  if (st->len == st->cap) {
+    size_t nsize = (st->cap == 0) ? 64 : 2*st->cap;
+    WalkFrame *nframes = (WalkFrame *) realloc(st->frames, sizeof(*st->frames) * nsize);
+    if (nframes == NULL)
       return -1;
+    st->frames = nframes;
+    st->cap = nsize;
   }
-  if (root_id >= 0) {
-    tree->post = circuit.topo_ord_len;
-    circuit.topo_ord[circuit.topo_ord_len++] = root_id;
-  }
+  st->frames[st->len++] = (WalkFrame) {.node = node, .link = link};
   return 0;
 }
 
-int topo_sort() {
-  circuit.topo_ord_len = 0;
-  for (int v=0; v<NODES_MAX; v++) {
-    if (circuit.trees[v] != NULL) {
-      circuit.trees[v]->visited = false;
-      circuit.trees[v]->post = -1;
+/* Post-order walk of [tree] without recursion: [visit] gets every node after its children,
+   left one first, and returns the node that takes its place or NULL to stop the walk.
+   Returns what took place of [tree] or NULL on error. */
+ParseTree rewrite_tree(ParseTree tree, ParseTree (*visit)(ParseTree, void *), void *arg) {
+  WalkStack st = {0};
+  ParseTree result = NULL;
+  if (walk_push(&st, tree, &result) < 0)
+    return NULL;
+  while (st.len > 0) {
+    WalkFrame *f = &st.frames[st.len - 1];
+    ParseTree t = f->node;
+    if (f->state == 0 && t->type == BINARY) {
+      f->state = 1;
+      if (walk_push(&st, t->left, &t->left) < 0)
+        break;
+    }
+    else if (f->state < 2 && (t->type == BINARY || t->type == UNARY)) {
+      f->state = 2;
+      if (walk_push(&st, t->right, &t->right) < 0)
+        break;
+    }
+    else {
+      st.len--;
+      if ((*f->link = visit(t, arg)) == NULL)
+        break;
     }
   }
-  for (int v=0; v<NODES_MAX; v++) {
-    if (circuit.trees[v] != NULL && (!(circuit.trees[v]->visited))) {
-      if (dfs(circuit.trees[v], v) < 0)
-        return -1;
+  if (st.len > 0)
+    result = NULL;
+  free(st.frames);
+  return result;
+}
+
+ParseTree fold_visit(ParseTree tree, void *arg) {
+  return fold_node(tree);
+}
+
+/* Simplifies freshly parsed [tree] before any process is spawned for it, returns its new root */
+ParseTree simplify(ParseTree tree) {
+  return rewrite_tree(tree, fold_visit, NULL);
+}
+
+/* Replaces [tree], whose children are already shared, with its canonical copy */
+ParseTree share_visit(ParseTree tree, void *root) {
+  if (tree != root) {
+    ParseTree *slot = cons_slot(tree);
+    if (slot == NULL)
+      return NULL;
+    if (*slot != NULL) {
+      drop_node(tree);
+      return *slot;
+    }
+    *slot = tree;
+    circuit.cons_len++;
+  }
+  if (tree->type == BINARY)
+    tree->left->parents++;
+  if (tree->type == BINARY || tree->type == UNARY)
+    tree->right->parents++;
+  return tree;
+}
+
+/* Hash-consing: replaces subtrees of freshly parsed [tree] with their canonical copies, so
+   equal subexpressions and leaves labeled with the same variable become one node and the
+   parse trees form a DAG. Duplicates are freed. Root of equation is never merged. */
+ParseTree share_subtrees(ParseTree tree) {
+  return rewrite_tree(tree, share_visit, tree);
+}
+
+/* Gets first element of grammar alphabet from line sufix, stores it in [label] and returns
+  the type of the match */
+NodeType retrieve_var(char **line, Label *label) {
+  int value;
+  char c = scan_token(line, &value);
+  switch (c) {
+    case 'x':
+      label->var = value;
+      return VAR;
+    case '0':
+      label->num = value;
+      return PNUM;
+    case '+':
+    case '*':
+      label->op = c;
+      return BINARY;
+    case '-':
+      label->op = c;
+      return UNARY;
+  }
+  return UNRECOGNIZED_TYPE_ERR;
+}
+
+/* Parses fully parenthesized expression from [line] with two explicit stacks: operators
+   waiting for their closing parenthesis and expressions parsed so far. Closing parenthesis
+   joins the operator with the expression on top and, if it is binary, with the one below.
+   Returns NULL on error. */
+ParseTree parse_line(char **line) {
+  WalkStack ops = {0}, exprs = {0};
+  ParseTree result = NULL;
+  bool err = false;
+  while (!err) {
+    while (is_blank(**line) || **line == '(') {
+      ++(*line);
+    }
+    if (**line == '\n') {
+      if (ops.len == 0 && exprs.len > 0)
+        result = exprs.frames[exprs.len - 1].node;
+      break;
+    }
+    if (**line == ')') {
+      ++(*line);
+      if (ops.len == 0 || exprs.len < 1 + (ops.frames[ops.len - 1].node->type == BINARY)) {
+        err = true;
+        continue;
+      }
+      ParseTree op = ops.frames[--ops.len].node;
+      op->right = exprs.frames[--exprs.len].node;
+      if (op->type == BINARY)
+        op->left = exprs.frames[--exprs.len].node;
+      err = (walk_push(&exprs, op, NULL) < 0);
+      continue;
+    }
+    Label label;
+    NodeType nodetype;
+    if ((nodetype = retrieve_var(line, &label)) == UNRECOGNIZED_TYPE_ERR) {
+      err = true;
+      continue;
     }
+    ParseTree tree = new_tree(nodetype, label);
+    if (tree == NULL)
+      err = true;
+    else if (nodetype == PNUM || nodetype == VAR)
+      err = (walk_push(&exprs, tree, NULL) < 0);
+    else //operators wait for expressions that follow them
+      err = (walk_push(&ops, tree, NULL) < 0);
+  }
+  free(ops.frames);
+  free(exprs.frames);
+  return err ? NULL : result;
+}
+
+int intlist_push(IntList *l, int v) {
+  if (l->len == l->cap) {
+    size_t nsize = (l->cap == 0) ? 4 : 2*l->cap;
+    int *nlist = (int *) realloc(l->list, sizeof(*l->list) * nsize);
+    if (nlist == NULL)
+      return -1;
+    l->list = nlist;
+    l->cap = nsize;
   }
+  l->list[l->len++] = v;
   return 0;
 }
 
-// Creates pipes between x root nad x labeled leaf
-int register_pipe(ParseTree varLabeledLeaf) {
-  int v = varLabeledLeaf->label.var;
-  ParseTree root = circuit.trees[v];
-  if (root->root_read_from_var == NULL) {
-    int DEFAULT_PIPES_QUANT = 1;
-    root->root_read_from_var = (int *) calloc(DEFAULT_PIPES_QUANT, sizeof(*(root->root_read_from_var)));
-    root->root_write_to_var = (int *) calloc(DEFAULT_PIPES_QUANT, sizeof(*(root->root_write_to_var)));
-    root->var_read_from_root = (int *) calloc(DEFAULT_PIPES_QUANT, sizeof(*(root->var_read_from_root)));
-    root->var_write_to_root = (int *) calloc(DEFAULT_PIPES_QUANT, sizeof(*(root->var_write_to_root)));
-    int *arrays[4] = {root->root_read_from_var, root->root_write_to_var, root->var_read_from_root, root->var_write_to_root};
-    for (int i=0; i<4; i++) {
-      if (arrays[i] == NULL)
-        return -1;
+/* Gathers variables that labels leaves of [tree] on the deps list of entry [e]. */
+int collect_deps(ParseTree tree, int e) {
+  WalkStack st = {0};
+  int ret = walk_push(&st, tree, NULL);
+  while (ret == 0 && st.len > 0) {
+    tree = st.frames[--st.len].node;
+    if (tree->type == VAR) {
+      int d = var_entry(tree->label.var, true);
+      if (d < 0) {
+        ret = -1;
+      }
+      else if (circuit.var_table[d].seen != e+1) {
+        circuit.var_table[d].seen = e+1;
+        if (intlist_push(&circuit.var_table[e].deps, d) < 0 || intlist_push(&circuit.var_table[d].users, e) < 0)
+          ret = -1;
+      }
+    }
+    else if (tree->type == UNARY || tree->type == BINARY) { //right subtree goes first
+      if (tree->type == BINARY)
+        ret = walk_push(&st, tree->left, NULL);
+      if (ret == 0)
+        ret = walk_push(&st, tree->right, NULL);
     }
-    root->pipes_list_cap = DEFAULT_PIPES_QUANT;
   }
-  else if (root->pipes_counter == root->pipes_list_cap) {
-    int nsize = root->pipes_list_cap * 2;
-    int **arrays[4] = {&root->root_read_from_var, &root->root_write_to_var,
-                     &root->var_read_from_root, &root->var_write_to_root};
-    int *narrays[4];
-    for (int i=0; i<4; i++) {
-      narrays[i] = realloc(*arrays[i], sizeof(int)*nsize); 
-      if (narrays[i] == NULL)
-        return -1;
+  free(st.frames);
+  return ret;
+}
+
+/* Marks trees reachable from entry [e] through users (forward) or deps (backward) which lie
+   strictly between [lb] and [ub] and appends them to [reached]. Returns -1 if tree at [ub]
+   is reached, so there is a cycle. */
+int dfs(int e, bool forward, int lb, int ub, IntList *reached) {
+  IntList stack = {0};
+  circuit.var_table[e].tree->visited = true;
+  int ret = intlist_push(reached, e);
+  if (ret == 0)
+    ret = intlist_push(&stack, e);
+  while (ret == 0 && stack.len > 0) {
+    VarEntry *entry = &circuit.var_table[stack.list[--stack.len]];
+    IntList *next = forward ? &entry->users : &entry->deps;
+    for (int j=0; j<next->len && ret == 0; j++) {
+      ParseTree t = circuit.var_table[next->list[j]].tree;
+      if (t == NULL || t->visited)
+        continue;
+      if (forward && t->post == ub) {
+        ret = -1;
+      }
+      else if (t->post > lb && t->post < ub) {
+        t->visited = true;
+        if (intlist_push(reached, next->list[j]) < 0 || intlist_push(&stack, next->list[j]) < 0)
+          ret = -1;
+      }
+    }
+  }
+  free(stack.list);
+  return ret;
+}
+
+/* Pearce-Kelly forward search: visits trees using entry [e] that lie before position [ub],
+   returns -1 if tree at [ub] is reached, so there is a cycle. */
+int dfs_forward(int e, int ub, IntList *reached) {
+  return dfs(e, true, -1, ub, reached);
+}
+
+/* Pearce-Kelly backward search: visits trees entry [e] depends on that lie after position [lb]. */
+int dfs_backward(int e, int lb, IntList *reached) {
+  return dfs(e, false, lb, circuit.topo_hi, reached);
+}
+
+int cmp_post(const void *a, const void *b) {
+  return circuit.var_table[*(int *) a].tree->post - circuit.var_table[*(int *) b].tree->post;
+}
+
+/* Restores topological order after edge [e] -> [u] (equation of [u] uses [e]) was added
+   while [u] preceded [e]. Returns -1 if the edge closes a cycle. */
+int reorder(int e, int u) {
+  IntList forward = {0}, backward = {0};
+  int lb = circuit.var_table[u].tree->post, ub = circuit.var_table[e].tree->post;
+  int ret = dfs_forward(u, ub, &forward);
+  if (ret == 0)
+    ret = dfs_backward(e, lb, &backward);
+  int *positions = NULL;
+  if (ret == 0 && (positions = calloc(forward.len + backward.len, sizeof(int))) == NULL)
+    ret = -1;
+  if (ret == 0) {
+    //trees reached backward go first, then the ones reached forward, to the very same positions,
+    //which are the two sorted lists of positions merged
+    qsort(forward.list, forward.len, sizeof(int), cmp_post);
+    qsort(backward.list, backward.len, sizeof(int), cmp_post);
+    for (int j=0, b=0, f=0; j<backward.len + forward.len; j++) {
+      int pb = (b < backward.len) ? circuit.var_table[backward.list[b]].tree->post : INT_MAX;
+      int pf = (f < forward.len) ? circuit.var_table[forward.list[f]].tree->post : INT_MAX;
+      positions[j] = (pb < pf) ? pb : pf;
+      (pb < pf) ? b++ : f++;
     }
-    for (int i=0; i<4; i++) {
-      *arrays[i] = narrays[i];
+    for (int j=0; j<backward.len + forward.len; j++) {
+      VarEntry *entry = &circuit.var_table[(j < backward.len) ? backward.list[j] : forward.list[j - backward.len]];
+      entry->tree->post = positions[j];
+      circuit.topo_ord[positions[j]] = entry->var;
     }
-    root->pipes_list_cap = nsize;
   }
-  int w_to_root[2];
-  int w_to_var[2];
-  if (pipe(w_to_root) < 0 || pipe(w_to_var) < 0)
+  for (int j=0; j<forward.len; j++)
+    circuit.var_table[forward.list[j]].tree->visited = false;
+  for (int j=0; j<backward.len; j++)
+    circuit.var_table[backward.list[j]].tree->visited = false;
+  free(positions);
+  free(forward.list);
+  free(backward.list);
+  return ret;
+}
+
+#define TOPO_SHIFT_MAX 32 //trees moved to make room for a new one before the order is spread
+
+/* Moves trees of topo_ord to a larger array, every one followed by a gap and with room for
+   as many trees again on both ends */
+int spread_order() {
+  size_t len = circuit.topo_ord_len;
+  size_t nsize = 4*len + 64;
+  int *nord = (int *) malloc(sizeof(*nord) * nsize);
+  if (nord == NULL)
     return -1;
-  varLabeledLeaf->pipe_id = root->pipes_counter;
-  root->root_write_to_var[root->pipes_counter] = w_to_var[1];
-  root->var_read_from_root[root->pipes_counter] = w_to_var[0];
-  root->var_write_to_root[root->pipes_counter] = w_to_root[1];
-  root->root_read_from_var[root->pipes_counter++] = w_to_root[0];
+  for (size_t j=0; j<nsize; j++)
+    nord[j] = -1;
+  size_t lo = len + 32, at = lo;
+  for (size_t j=circuit.topo_lo; j<circuit.topo_hi; j++) {
+    if (circuit.topo_ord[j] < 0)
+      continue;
+    tree_of(circuit.topo_ord[j])->post = at;
+    nord[at] = circuit.topo_ord[j];
+    at += 2;
+  }
+  free(circuit.topo_ord);
+  circuit.topo_ord = nord;
+  circuit.topo_ord_cap = nsize;
+  circuit.topo_lo = lo;
+  circuit.topo_hi = (at > lo) ? at - 1 : lo;
   return 0;
 }
 
-int extern_var(ParseTree tree) {
-  if (tree->type == VAR) {
-    if (circuit.trees[tree->label.var] != NULL && register_pipe(tree) < 0)
-      return -1;
-    // create pipes to circuit
-    int w_to_circuit[2];
-    int w_to_var[2];
-    if (pipe(w_to_circuit) < 0 || pipe(w_to_var) < 0)
-      return -1;
-    tree->var_read_from_circuit = w_to_var[0];
-    tree->var_write_to_circuit = w_to_circuit[1];
-    tree->circuit_write_to_var = w_to_var[1];
-    tree->circuit_read_from_var = w_to_circuit[0];
+/* Moves trees between slot [from] and empty slot [to] by one towards [to], so that [from]
+   becomes free */
+void shift_order(size_t from, size_t to) {
+  if (from < to) {
+    for (size_t j=to; j>from; j--) {
+      circuit.topo_ord[j] = circuit.topo_ord[j-1];
+      if (circuit.topo_ord[j] >= 0)
+        tree_of(circuit.topo_ord[j])->post = j;
+    }
   }
-  else if (tree->type == BINARY || tree->type == UNARY) {
-    if (extern_var(tree->right) < 0 || ((tree->type == BINARY) && (extern_var(tree->left) < 0)))
+  else {
+    for (size_t j=to; j<from; j++) {
+      circuit.topo_ord[j] = circuit.topo_ord[j+1];
+      if (circuit.topo_ord[j] >= 0)
+        tree_of(circuit.topo_ord[j])->post = j;
+    }
+  }
+}
+
+/* Empty slot right before the tree at [at], or after the last tree if [at] is -1, trees
+   nearby are moved to make it. Returns -1 if memory ran out. */
+long free_slot(long at) {
+  while (true) {
+    long lo = circuit.topo_lo, hi = circuit.topo_hi, cap = circuit.topo_ord_cap;
+    if (at < 0 && hi < cap)
+      return circuit.topo_hi++;
+    for (long d=1; at >= 0 && d<=TOPO_SHIFT_MAX; d++) {
+      long l = at - d, r = at + d - 1;
+      if (l >= 0 && (l < lo || circuit.topo_ord[l] < 0)) { //trees in between go left
+        if (l < lo)
+          circuit.topo_lo = l;
+        shift_order(at - 1, l);
+        return at - 1;
+      }
+      if (r < cap && (r >= hi || circuit.topo_ord[r] < 0)) { //tree at [at] and the rest go right
+        if (r >= hi)
+          circuit.topo_hi = r + 1;
+        shift_order(at, r);
+        return at;
+      }
+    }
+    ParseTree t = (at >= 0) ? tree_of(circuit.topo_ord[at]) : NULL;
+    if (spread_order() < 0)
       return -1;
+    if (t != NULL)
+      at = t->post;
   }
-  return 0;
 }
 
-/* Prepares descriptors used to communicate between trees roots and 
-   leaves labeled with particular variable. */
-int prepare_non_tree_pipes() {
-  for (int v=circuit.topo_ord_len - 1; v>=0; v--) {
-    if (extern_var(circuit.trees[circuit.topo_ord[v]]) < 0)
+/* Closes the gaps of topo_ord, so that positions of trees become their ranks */
+void pack_order() {
+  size_t len = 0;
+  for (size_t j=circuit.topo_lo; j<circuit.topo_hi; j++) {
+    if (circuit.topo_ord[j] < 0)
+      continue;
+    tree_of(circuit.topo_ord[j])->post = len;
+    circuit.topo_ord[len++] = circuit.topo_ord[j];
+  }
+  circuit.topo_lo = 0;
+  circuit.topo_hi = len;
+}
+
+/* Adds [tree] as equation of x[v] keeping topo_ord valid. It goes right before the first
+   tree using x[v], or after all the trees if there is none, so only its dependencies on
+   trees lying after it make Pearce-Kelly reorder anything. Returns -1 if equation makes
+   a cycle. */
+int add_tree(int v, ParseTree tree) {
+  int e = var_entry(v, true);
+  if (e < 0)
+    return -1;
+  circuit.var_table[e].tree = tree;
+  tree->is_root = true;
+  if (collect_deps(tree, e) < 0)
+    return -1;
+  if (circuit.var_table[e].seen == e+1) //x[v] refers to itself
+    return -1;
+  int first = -1;
+  IntList *users = &circuit.var_table[e].users;
+  for (int j=0; j<users->len; j++) {
+    int post = circuit.var_table[users->list[j]].tree->post;
+    if (first < 0 || post < first)
+      first = post;
+  }
+  long slot = free_slot(first);
+  if (slot < 0)
+    return -1;
+  tree->post = slot;
+  circuit.topo_ord[slot] = v;
+  circuit.topo_ord_len++;
+  IntList *deps = &circuit.var_table[e].deps;
+  for (int j=0; j<deps->len; j++) {
+    ParseTree dep = circuit.var_table[deps->list[j]].tree;
+    if (dep != NULL && dep->post > tree->post && reorder(deps->list[j], e) < 0)
       return -1;
   }
   return 0;
@@ -330,6 +1156,7 @@ int prepare_non_tree_pipes() {
 
 /* And now somethng completely different. */
 void looming_doom(char *ERR) {
+  trace_dump();
   free_circuit();
   if (ERR != NULL)
     syserr(ERR);
@@ -341,524 +1168,3092 @@ void close_pipe_or_perish_any_hope(int pipe, char *err) {
     looming_doom(err);
 }
 
-void send_message(int to, int i, long val, bool err) {
-  if (message == NULL)
-    message = calloc(1, sizeof(*message));
-  if (message == NULL) {
-    looming_doom("CALLOC IN SM");
+/* Makes sure [mailbox] has buffers for descriptor [fd] */
+void mailbox_reserve(int fd) {
+  if (fd < mailbox.fds)
+    return;
+  int nsize = (mailbox.fds == 0) ? 16 : mailbox.fds;
+  while (nsize <= fd)
+    nsize *= 2;
+  MesBuf *nin = (MesBuf *) realloc(mailbox.in, sizeof(*mailbox.in) * nsize);
+  if (nin == NULL)
+    looming_doom("MAILBOX REALLOC");
+  mailbox.in = nin;
+  MesBuf *nout = (MesBuf *) realloc(mailbox.out, sizeof(*mailbox.out) * nsize);
+  if (nout == NULL)
+    looming_doom("MAILBOX REALLOC");
+  mailbox.out = nout;
+  int *ndirty = (int *) realloc(mailbox.dirty, sizeof(*mailbox.dirty) * nsize);
+  if (ndirty == NULL)
+    looming_doom("MAILBOX REALLOC");
+  mailbox.dirty = ndirty;
+  Ring **nrings = (Ring **) realloc(mailbox.rings, sizeof(*mailbox.rings) * nsize);
+  if (nrings == NULL)
+    looming_doom("MAILBOX REALLOC");
+  mailbox.rings = nrings;
+  for (int i=mailbox.fds; i<nsize; i++) {
+    mailbox.in[i] = (MesBuf) {0};
+    mailbox.out[i] = (MesBuf) {0};
+    mailbox.rings[i] = NULL;
   }
-  message->i = i;
-  message->val = val;
-  message->err = err;
-  if (write(to, message, sizeof(*message)) <= 0)
-    looming_doom("WRITE IN SM");
+  mailbox.fds = nsize;
 }
 
-void pnum_response(ParseTree self, int i, int from) {
-  int write2 = (from == 0)? self->write_to_parent : self->root_write_to_var[from-1]; 
-  send_message(write2, i, self->label.var, false);
+/* Makes room for [size] more bytes at the end of [mb] */
+void mesbuf_reserve(MesBuf *mb, size_t size) {
+  if (mb->len + size <= mb->cap)
+    return;
+  size_t nsize = (mb->cap == 0) ? BATCH_CAP : mb->cap;
+  while (nsize < mb->len + size)
+    nsize *= 2;
+  char *nbuf = (char *) realloc(mb->buf, nsize);
+  if (nbuf == NULL)
+    looming_doom("MESBUF REALLOC");
+  mb->buf = nbuf;
+  mb->cap = nsize;
 }
 
-void broadcast(ParseTree self, int x, int *cache_status, long *cached, int i, long val, int status) {
-  if (cache_status[i] <= 0) {
-    if (status) {
-      cache_status[i] = 1;
-    }
-    else {
-      cache_status[i] = 2;
-      cached[i] = val;
-    }
+/* Maps rings for at most [cap] pipes, without them messages go through pipes */
+void open_arena(size_t cap) {
+  size_t size = sizeof(RingArena) + cap * sizeof(Ring);
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (mem == MAP_FAILED)
+    return;
+  arena = mem;
+  arena->cap = cap;
+  arena->size = size;
+}
+
+/* pipe() with both ends nonblocking, which gets a ring if there is any left. Channel with
+   a ring is a socket pair instead, so that its reader can ring back to the writer. */
+int open_channel(int fds[2]) {
+  Ring *ring = NULL;
+  if (arena != NULL) {
+    size_t k = atomic_fetch_add(&arena->used, 1);
+    if (k < arena->cap)
+      ring = &arena->rings[k];
   }
-  if (!self->is_root || x == 0) // trees different than 0 should not respond to parent (circuit)
-    send_message(self->write_to_parent, i, val, status);
-  for (int j=0; j<self->pipes_counter; j++) {
-    send_message(self->root_write_to_var[j], i, val, status);
+  if ((ring != NULL) ? socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 : pipe(fds) < 0)
+    return -1;
+  for (int k=0; k<2; k++) {
+    if (fcntl(fds[k], F_SETFL, fcntl(fds[k], F_GETFL) | O_NONBLOCK) < 0)
+      return -1;
   }
+  mailbox_reserve((fds[0] > fds[1]) ? fds[0] : fds[1]);
+  mailbox.rings[fds[0]] = mailbox.rings[fds[1]] = ring;
+  return 0;
 }
 
-void send_cached(ParseTree self, int *cache_status, long *cached, Mes *mes, int from, int n) {
-  if (cache_status[mes->i] > 0) { //already responded for this query
-    if (from < n) { // it was actually a query not some delayed response
-      int write2 = (from == 0) ? self->write_to_parent : self->root_write_to_var[from-1];
-      if (cache_status[mes->i] == 1) { //not possible to compute value with given initial list
-        send_message(write2, mes->i, 0, true);
-      }
-      else {
-        send_message(write2, mes->i, cached[mes->i], false);
-      }
-    }
-  }
+/* Copies as much of [len] bytes as fits into [ring] and returns how much it was, rings
+   the bell of the pipe [fd] unless the reader was already told to look */
+size_t ring_write(int fd, Ring *ring, const char *buf, size_t len) {
+  uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t room = RING_CAP - (tail - atomic_load(&ring->head));
+  size_t n = (len < room) ? len : room;
+  if (n == 0)
+    return 0;
+  size_t at = tail & (RING_CAP - 1);
+  size_t first = (n < RING_CAP - at) ? n : RING_CAP - at;
+  memcpy(ring->data + at, buf, first);
+  memcpy(ring->data, buf + first, n - first);
+  atomic_store(&ring->tail, tail + n);
+  if (atomic_exchange(&ring->bell, 1) == 0 && write(fd, "", 1) != 1)
+    looming_doom("RING BELL");
+  return n;
 }
 
-void op_response(ParseTree self, int x, int *cache_status, long *cached, Mes *mes, int from, int n) {
-  if (cache_status[mes->i] > 0) { //already responded for this query
-    send_cached(self, cache_status, cached, mes, from, n);
-  }
-  else if (cache_status[mes->i] == 0) { //know nothing, ask children
-    cache_status[mes->i] = -1;
-    send_message(self->right->parent_write_to_me, mes->i, 0, false);
-    if (self->type == BINARY)
-      send_message(self->left->parent_write_to_me, mes->i, 0, false);
-  }
-  else { //waiting for children's 
-    if (from >= n) { //so only children should be indeed waited on
-      if (mes->err) { // one of the subtrees cannot be comptued with given init list 
-        broadcast(self, x, cache_status, cached, mes->i, 0, true);
-      }
-      else {
-        if (self->type == UNARY) {
-          broadcast(self, x, cache_status, cached, mes->i, -mes->val, false);
-        }
-        else {
-          if (cache_status[mes->i] == -2) {
-            long val = cached[mes->i];
-            val = (self->label.op == '+')? val + mes->val : val * mes->val;
-            broadcast(self, x, cache_status, cached, mes->i, val, false);
-          }
-          else {
-            cache_status[mes->i] = -2;
-            cached[mes->i] = mes->val;
-          }
-        }
-      }
+/* Takes everything [ring] holds together with the bell from pipe [fd] if there is one,
+   returns 0 if writer is gone, -1 on error and 1 otherwise */
+ssize_t ring_read(int fd, Ring *ring, MesBuf *mb) {
+  uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  ssize_t got = 1;
+  //pipe holds nothing but bells, so without one and with no data there is only the hangup
+  if (atomic_load(&ring->bell) || atomic_load(&ring->tail) == head) {
+    char bells[64];
+    if ((got = read(fd, bells, sizeof(bells))) < 0) {
+      if (errno != EAGAIN)
+        return -1;
+      got = 1; //bell is on its way, it will wake us once more
     }
+    atomic_store(&ring->bell, 0); //anything written from now on comes with a new bell
   }
+  uint32_t n = atomic_load(&ring->tail) - head;
+  mesbuf_reserve(mb, n);
+  size_t at = head & (RING_CAP - 1);
+  size_t first = (n < RING_CAP - at) ? n : RING_CAP - at;
+  memcpy(mb->buf + mb->len, ring->data + at, first);
+  memcpy(mb->buf + mb->len + first, ring->data, n - first);
+  mb->len += n;
+  atomic_store(&ring->head, head + n);
+  //writer that is gone does not need to know, so no SIGPIPE for that
+  if (n > 0 && atomic_load(&ring->full) && atomic_exchange(&ring->full, 0))
+    send(fd, "", 1, MSG_NOSIGNAL);
+  return (got == 0) ? 0 : 1;
 }
 
-void var_response(ParseTree self, int x, int *cache_status, long *cached, Mes *mes, int from, int n) {
-  if (cache_status[mes->i] > 0) { //already responded for this query
-    send_cached(self, cache_status, cached, mes, from, n);
-  }
-  else if (cache_status[mes->i] == 0) { //know nothing, ask circuit
-    cache_status[mes->i] = -1;
-    send_message(self->var_write_to_circuit, mes->i, 0, false);
+/* Makes the event loop wake when the reader of [fd] makes room for its pending output:
+   ring's reader rings back through the socket pair, a pipe becomes writable */
+void watch_room(int fd) {
+  struct epoll_event ev = {.events = ((mailbox.rings[fd] != NULL) ? EPOLLIN : EPOLLOUT) | EPOLLET,
+      .data.u32 = LOOP_ROOM | fd};
+  if (mailbox.epfd >= 0 && epoll_ctl(mailbox.epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+    looming_doom("EPOLL ADD");
+}
+
+/* Writes out everything that was gathered for descriptor [fd], returns false if some of it
+   did not fit into the ring or pipe. Nobody blocks on a full one, as its reader might be
+   blocked on us the same way. */
+bool flush_fd(int fd) {
+  MesBuf *mb = &mailbox.out[fd];
+  size_t head = mb->head;
+  Ring *ring = mailbox.rings[fd];
+  if (ring != NULL) {
+    mb->head += ring_write(fd, ring, mb->buf + mb->head, mb->len - mb->head);
+    if (mb->head < mb->len) {
+      //reader who emptied the ring before it saw the flag does not ring back, so look again
+      atomic_store(&ring->full, 1);
+      mb->head += ring_write(fd, ring, mb->buf + mb->head, mb->len - mb->head);
+    }
+  }
+  else {
+    while (mb->head < mb->len) {
+      ssize_t len = write(fd, mb->buf + mb->head, mb->len - mb->head);
+      if (len < 0 && errno == EAGAIN)
+        break;
+      if (len <= 0)
+        looming_doom("WRITE IN SM");
+      mb->head += len;
+    }
+  }
+  counters.bytes_written += mb->head - head;
+  if (mb->head < mb->len) {
+    if (2*mb->head >= mb->len) { //keep the leftover from wandering off
+      memmove(mb->buf, mb->buf + mb->head, mb->len - mb->head);
+      mb->len -= mb->head;
+      mb->head = 0;
+    }
+    watch_room(fd);
+    return false;
+  }
+  mb->head = mb->len = 0;
+  return true;
+}
+
+/* Writes out pending output of all the descriptors, returns false if some of it has
+   to wait for room in the rings */
+bool flush_messages() {
+  int left = 0;
+  for (int j=0; j<mailbox.dirty_len; j++) {
+    if (!flush_fd(mailbox.dirty[j]))
+      mailbox.dirty[left++] = mailbox.dirty[j];
+  }
+  mailbox.dirty_len = left;
+  return left == 0;
+}
+
+/* Writes [v] 7 bits a byte, the least significant first, returns bytes written */
+static inline size_t put_varint(char *buf, unsigned long v) {
+  size_t n = 0;
+  for (; v >= 0x80; v >>= 7)
+    buf[n++] = (char) (v | 0x80);
+  buf[n++] = (char) v;
+  return n;
+}
+
+/* Reads varint from [*p] not past [end] into [v], returns false if it is not whole yet */
+static inline bool get_varint(const char **p, const char *end, unsigned long *v) {
+  *v = 0;
+  for (int shift=0; *p < end && shift < 64; shift += 7) {
+    unsigned char b = *(*p)++;
+    *v |= (unsigned long) (b & 0x7f) << shift;
+    if (b < 0x80)
+      return true;
+  }
+  if (*p < end) //longer than any long
+    looming_doom("BAD MESSAGE");
+  return false;
+}
+
+/* Appends message to the batch of descriptor [to] without flushing it, [at] goes with it
+   unless it is -1 */
+void enqueue_at(int to, int i, int at, Num val, bool err) {
+  mailbox_reserve(to);
+  MesBuf *mb = &mailbox.out[to];
+  if (mb->len == 0)
+    mailbox.dirty[mailbox.dirty_len++] = to;
+  size_t len = (val.big != NULL) ? big_size(val.big) : 0;
+  mesbuf_reserve(mb, MES_MAX + len);
+  char *p = mb->buf + mb->len;
+  *p = (char) ((len > 0) ? TAG_BIG : ((val.val != 0) ? TAG_LONG : TAG_BARE)) | (err ? TAG_ERR : 0);
+  *p |= (at >= 0) ? TAG_AT : 0;
+  p += 1 + put_varint(p + 1, (unsigned int) i);
+  if (at >= 0)
+    p += put_varint(p, (unsigned int) at);
+  if (len > 0) {
+    p += put_varint(p, len);
+    memcpy(p, val.big, len);
+    p += len;
+  }
+  else if (val.val != 0) {
+    p += put_varint(p, ((unsigned long) val.val << 1) ^ (unsigned long) (val.val >> 63));
+  }
+  mb->len = p - mb->buf;
+  counters.sent++;
+}
+
+void enqueue_message(int to, int i, long val, bool err) {
+  enqueue_at(to, i, -1, (Num) {val, NULL}, err);
+}
+
+void send_at(int to, int i, int at, Num val, bool err) {
+  enqueue_at(to, i, at, val, err);
+  if (mailbox.out[to].len - mailbox.out[to].head >= BATCH_CAP && flush_fd(to)) {
+    for (int j=0; j<mailbox.dirty_len; j++) {
+      if (mailbox.dirty[j] == to) {
+        mailbox.dirty[j] = mailbox.dirty[--mailbox.dirty_len];
+        break;
+      }
+    }
+  }
+}
+
+void send_value(int to, int i, Num val, bool err) {
+  send_at(to, i, -1, val, err);
+}
+
+void send_message(int to, int i, long val, bool err) {
+  send_at(to, i, -1, (Num) {val, NULL}, err);
+}
+
+/* Reads from pipe [fd] until it is empty, returns like receive_messages */
+ssize_t read_pipe(int fd, MesBuf *mb) {
+  while (true) {
+    mesbuf_reserve(mb, BATCH_CAP);
+    size_t room = mb->cap - mb->len;
+    ssize_t len = read(fd, mb->buf + mb->len, room);
+    if (len < 0)
+      return (errno == EAGAIN) ? 1 : -1;
+    if (len == 0)
+      return 0;
+    mb->len += len;
+    if (len < room) //pipe gave all it had
+      return 1;
+  }
+}
+
+/* Reads everything available from [fd] into its input batch, returns 0 if writer is gone,
+   -1 on error and 1 otherwise */
+ssize_t receive_messages(int fd) {
+  mailbox_reserve(fd);
+  MesBuf *mb = &mailbox.in[fd];
+  if (mb->head > 0) {
+    memmove(mb->buf, mb->buf + mb->head, mb->len - mb->head);
+    mb->len -= mb->head;
+    mb->head = 0;
+  }
+  size_t len = mb->len;
+  ssize_t ret = (mailbox.rings[fd] != NULL) ? ring_read(fd, mailbox.rings[fd], mb) : read_pipe(fd, mb);
+  counters.bytes_read += mb->len - len;
+  return ret;
+}
+
+/* Pops next complete message received from [fd], returns false if there is none */
+bool next_message(int fd, Mes *mes) {
+  MesBuf *mb = &mailbox.in[fd];
+  const char *p = mb->buf + mb->head, *end = mb->buf + mb->len;
+  unsigned long i, at = -1, v = 0;
+  if (p == end)
+    return false;
+  char tag = *p++;
+  //nothing is taken off the batch until the whole message is there
+  if (!get_varint(&p, end, &i) || ((tag & TAG_AT) && !get_varint(&p, end, &at)))
+    return false;
+  if ((tag & ~(TAG_ERR | TAG_AT)) != TAG_BARE && !get_varint(&p, end, &v))
+    return false;
+  mes->i = (int) i;
+  mes->at = (int) at;
+  mes->err = (tag & TAG_ERR) != 0;
+  mes->val = (Num) {0, NULL};
+  switch (tag & ~(TAG_ERR | TAG_AT)) {
+    case TAG_BARE:
+      break;
+    case TAG_LONG:
+      mes->val.val = (long) (v >> 1) ^ -(long) (v & 1);
+      break;
+    case TAG_BIG:
+      if (end - p < v) //big value is not whole yet
+        return false;
+      if ((mes->val.big = big_decode(p, v)) == NULL)
+        looming_doom("BIG VALUE");
+      p += v;
+      break;
+    default:
+      looming_doom("BAD MESSAGE");
+  }
+  mb->head = p - mb->buf;
+  counters.received++;
+  return true;
+}
+
+/* Prepares [loop] for [n] descriptors */
+void loop_open(EventLoop *loop, int n) {
+  loop->cap = (n < 64) ? n : 64;
+  loop->events = calloc(loop->cap, sizeof(*loop->events));
+  if ((loop->epfd = epoll_create1(0)) < 0 || loop->events == NULL)
+    looming_doom("EPOLL CREATE");
+  mailbox.epfd = loop->epfd;
+}
+
+/* Watches [fd], its events come with [from] */
+void loop_add(EventLoop *loop, int fd, int from) {
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.u32 = from};
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    looming_doom("EPOLL ADD");
+}
+
+void loop_close(EventLoop *loop) {
+  if (mailbox.epfd == loop->epfd)
+    mailbox.epfd = -1;
+  close(loop->epfd);
+  free(loop->events);
+}
+
+/* Takes the bells readers rang back on [fd] or, if the reader is gone, drops the output
+   it will never read */
+void room_made(int fd, uint32_t events) {
+  if (events & (EPOLLHUP | EPOLLERR)) {
+    mailbox.out[fd].head = mailbox.out[fd].len = 0;
+    return;
+  }
+  char bells[64];
+  while (mailbox.rings[fd] != NULL && read(fd, bells, sizeof(bells)) == sizeof(bells));
+}
+
+/* Waits for descriptors that got something and, if none of them is ready, flushes pending
+   output before going to sleep. Output that did not fit is flushed again when its reader
+   makes room, these wakeups are not returned. Every ready descriptor must be drained, as
+   it is not reported again until more comes. */
+int loop_wait(EventLoop *loop) {
+  int ret = epoll_wait(loop->epfd, loop->events, loop->cap, 0);
+  if (ret == 0) {
+    counters.sleeps++;
+    flush_messages();
+    ret = epoll_wait(loop->epfd, loop->events, loop->cap, -1);
+  }
+  if (ret < 0 && errno == EINTR)
+    ret = 0;
+  if (ret > 0)
+    counters.wakeups++;
+  int left = 0;
+  for (int k=0; k<ret; k++) {
+    if (loop->events[k].data.u32 & LOOP_ROOM)
+      room_made(loop->events[k].data.u32 & ~LOOP_ROOM, loop->events[k].events);
+    else
+      loop->events[left++] = loop->events[k];
+  }
+  if (left < ret)
+    flush_messages();
+  return (ret < 0) ? ret : left;
+}
+
+
+/* Creates pipes between [top] node and its [client]: var leaf labeled with top's variable
+   or parent of shared node. Returns index of the pipes in top's arrays or -1 on error */
+int register_pipe(ParseTree top, ParseTree client) {
+  NodeIO *io = top->io;
+  if (io->pipes_counter == io->pipes_list_cap) {
+    int nsize = (io->pipes_list_cap == 0) ? 1 : 2*io->pipes_list_cap;
+    ClientPipes *nclients = realloc(io->clients, sizeof(*io->clients)*nsize);
+    if (nclients == NULL)
+      return -1;
+    io->clients = nclients;
+    io->pipes_list_cap = nsize;
+  }
+  int w_to_root[2];
+  int w_to_var[2];
+  if (open_channel(w_to_root) < 0 || open_channel(w_to_var) < 0)
+    return -1;
+  io->clients[io->pipes_counter] = (ClientPipes) {
+    .client = client,
+    .root_write_to_var = w_to_var[1],
+    .var_read_from_root = w_to_var[0],
+    .var_write_to_root = w_to_root[1],
+    .root_read_from_var = w_to_root[0]
+  };
+  return io->pipes_counter++;
+}
+
+int extern_var(ParseTree tree) {
+  if (tree->type == VAR) {
+    ParseTree root = tree_of(tree->label.var);
+    if (root != NULL && (tree->io->pipe_id = register_pipe(root, tree)) < 0)
+      return -1;
+    // create pipes to circuit
+    int w_to_circuit[2];
+    int w_to_var[2];
+    if (open_channel(w_to_circuit) < 0 || open_channel(w_to_var) < 0)
+      return -1;
+    tree->io->var_read_from_circuit = w_to_var[0];
+    tree->io->var_write_to_circuit = w_to_circuit[1];
+    tree->io->circuit_write_to_var = w_to_var[1];
+    tree->io->circuit_read_from_var = w_to_circuit[0];
+  }
+  else if (tree->type == BINARY || tree->type == UNARY) {
+    for (int k=0; k<1+(tree->type == BINARY); k++) {
+      ParseTree child = (k == 0) ? tree->right : tree->left;
+      if (!is_top(child))
+        continue; //pipes to this one are made when it's forked
+      int j = register_pipe(child, tree);
+      if (j < 0)
+        return -1;
+      tree->io->write_to_child[k] = child->io->clients[j].var_write_to_root;
+      tree->io->read_from_child[k] = child->io->clients[j].var_read_from_root;
+    }
+  }
+  return 0;
+}
+
+/* Marks nodes of [root] and, through var leaves, of trees of their variables needed */
+int mark_needed(ParseTree root) {
+  WalkStack st = {0};
+  if (root != NULL && walk_push(&st, root, NULL) < 0)
+    return -1;
+  while (st.len > 0) {
+    ParseTree t = st.frames[--st.len].node;
+    if (t->io->needed)
+      continue; //shared, or a tree reached by another leaf
+    t->io->needed = true;
+    ParseTree next[2] = {NULL, NULL};
+    if (t->type == VAR)
+      next[0] = tree_of(t->label.var);
+    else if (t->type == BINARY || t->type == UNARY)
+      next[0] = t->right;
+    if (t->type == BINARY)
+      next[1] = t->left;
+    for (int k=0; k<2; k++) {
+      if (next[k] != NULL && walk_push(&st, next[k], NULL) < 0) {
+        free(st.frames);
+        return -1;
+      }
+    }
+  }
+  free(st.frames);
+  return 0;
+}
+
+/* Gives the nodes their descriptors and lists roots of the equations x[0] depends on
+   among the tops. Only x[0] is ever asked, equations it does not reach stay idle. */
+int prepare_needed() {
+  circuit.tops = (ParseTree *) calloc(circuit.list_len + 1, sizeof(*circuit.tops));
+  circuit.io = (NodeIO *) calloc(circuit.list_len + 1, sizeof(*circuit.io));
+  if (circuit.tops == NULL || circuit.io == NULL)
+    return -1;
+  for (int i=0; i<circuit.list_len; i++)
+    circuit.variables[i]->io = &circuit.io[i];
+  if (mark_needed(tree_of(0)) < 0)
+    return -1;
+  for (int v=circuit.topo_ord_len - 1; v>=0; v--) {
+    if (tree_of(circuit.topo_ord[v])->io->needed)
+      circuit.tops[circuit.tops_len++] = tree_of(circuit.topo_ord[v]);
+  }
+  return 0;
+}
+
+/* Prepares descriptors used to communicate between top nodes and their clients:
+   leaves labeled with particular variable and parents of shared nodes. Only what x[0]
+   depends on is wired. */
+int prepare_non_tree_pipes() {
+  if (prepare_needed() < 0)
+    return -1;
+  for (int i=0; i<circuit.list_len; i++) {
+    ParseTree node = circuit.variables[i];
+    if (!node->io->needed)
+      continue;
+    if (!node->is_root && is_top(node))
+      circuit.tops[circuit.tops_len++] = node;
+    if (extern_var(node) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+void pnum_response(ParseTree self, int i, int from) {
+  int write2 = (from == 0)? self->io->write_to_parent : self->io->clients[from-1].root_write_to_var; 
+  send_message(write2, i, self->label.num, false);
+}
+
+CacheEntry *cache_find(QueryCache *c, int i) {
+  if (c->cap == 0)
+    return NULL;
+  for (size_t h = ((unsigned) i * 2654435761u) & (c->cap - 1); c->slots[h].i != -1; h = (h+1) & (c->cap - 1)) {
+    if (c->slots[h].i == i)
+      return &c->slots[h];
+  }
+  return NULL;
+}
+
+/* Inserts fresh entry for query [i], pointers to other entries are invalidated */
+CacheEntry *cache_add(QueryCache *c, int i) {
+  if (2*(c->len + 1) > c->cap) {
+    QueryCache nc = {0};
+    nc.cap = (c->cap == 0) ? 16 : 2*c->cap;
+    nc.vals_len = c->vals_len;
+    nc.slots = (CacheEntry *) malloc(sizeof(*nc.slots) * nc.cap);
+    if (nc.slots == NULL)
+      looming_doom("CACHE ALLOC");
+    for (size_t h=0; h<nc.cap; h++)
+      nc.slots[h].i = -1;
+    for (size_t h=0; h<c->cap; h++) {
+      if (c->slots[h].i != -1)
+        *cache_add(&nc, c->slots[h].i) = c->slots[h];
+    }
+    free(c->slots);
+    *c = nc;
   }
-  else if (cache_status[mes->i] == -1) { //waiting for circuit response
-    if (from == n) { //so only circuit should be indeed waited on
+  size_t h = ((unsigned) i * 2654435761u) & (c->cap - 1);
+  while (c->slots[h].i != -1)
+    h = (h+1) & (c->cap - 1);
+  c->len++;
+  c->slots[h] = (CacheEntry) {.i = i};
+  return &c->slots[h];
+}
+
+/* Frees values held by [e] of [c], there are none unless --max-procs or --bigint is on */
+void drop_vals(QueryCache *c, CacheEntry *e) {
+  if (e->val.big != NULL) {
+    free(e->val.big);
+    e->val.big = NULL;
+  }
+  if (e->vals != NULL) {
+    for (int k=0; k<c->vals_len; k++)
+      free(e->vals[k].big);
+    free(e->vals);
+    e->vals = NULL;
+  }
+}
+
+/* Removes [e] shifting back entries of its probe chain, so no tombstones are needed */
+void cache_remove(QueryCache *c, CacheEntry *e) {
+  size_t h = e - c->slots;
+  free(e->askers.list);
+  drop_vals(c, e);
+  for (size_t j = (h+1) & (c->cap - 1); c->slots[j].i != -1; j = (j+1) & (c->cap - 1)) {
+    size_t home = ((unsigned) c->slots[j].i * 2654435761u) & (c->cap - 1);
+    //entry at j may fill the hole at h unless its home lies cyclically in (h, j]
+    if ((j > h && (home <= h || home > j)) || (j < h && home <= h && home > j)) {
+      c->slots[h] = c->slots[j];
+      h = j;
+    }
+  }
+  c->slots[h].i = -1;
+  c->len--;
+}
+
+void free_cache(QueryCache *c) {
+  for (size_t h=0; h<c->cap; h++) {
+    if (c->slots[h].i != -1) {
+      free(c->slots[h].askers.list);
+      drop_vals(c, &c->slots[h]);
+    }
+  }
+  free(c->slots);
+}
+
+/* Sends answer of [e] to [from] */
+void reply(ParseTree self, int from, CacheEntry *e) {
+  int write2 = (from == 0) ? self->io->write_to_parent : self->io->clients[from-1].root_write_to_var;
+  send_value(write2, e->i, e->val, e->status == 1);
+}
+
+/* Stores the answer and sends it to everyone waiting for it, the entry takes its big. */
+void resolve(ParseTree self, CacheEntry *e, Num val, bool err) {
+  TRACE('e', "query", e->i);
+  e->status = err ? 1 : 2;
+  if (e->val.big == val.big) //passed on as it came
+    e->val.big = NULL;
+  free(e->val.big);
+  e->val = val;
+  if (!is_top(self)) {
+    reply(self, 0, e); //only parent could have asked
+  }
+  else {
+    for (int j=0; j<e->askers.len; j++)
+      reply(self, e->askers.list[j], e);
+    counters.replies += e->askers.len;
+    free(e->askers.list);
+    e->askers = (IntList) {0};
+  }
+}
+
+/* Handles the query from [from]. Returns entry of query which has to be computed
+   or NULL if the answer was already sent or is to be sent with the others. */
+CacheEntry *take_query(ParseTree self, QueryCache *c, Mes *mes, int from) {
+  CacheEntry *e = cache_find(c, mes->i);
+  if (e != NULL && e->status > 0) { //already responded for this query
+    counters.cache_hits++;
+    reply(self, from, e);
+    return NULL;
+  }
+  bool fresh = (e == NULL);
+  if (fresh) {
+    e = cache_add(c, mes->i);
+    e->status = -1;
+    TRACE('b', "query", mes->i);
+  }
+  else {
+    counters.cache_hits++; //joins the one in flight
+  }
+  if (is_top(self) && intlist_push(&e->askers, from) < 0)
+    looming_doom("ASKERS PUSH");
+  return fresh ? e : NULL;
+}
+
+/* Drops answered entries of queries up to [upto]. Tops keep answers for clients which may
+   ask late, but while streaming such a query belongs to a batch that is already over. */
+void cache_forget(QueryCache *c, int upto) {
+  for (size_t h=0; h<c->cap; h++) {
+    CacheEntry *e = &c->slots[h];
+    //removal shifts later entries back into h, so h is looked at again
+    while (e->i != -1 && e->i <= upto && e->status > 0 && e->pending == 0)
+      cache_remove(c, e);
+  }
+}
+
+/* Drops the entry once answer was sent and no more responses are coming. */
+void settle(ParseTree self, QueryCache *c, CacheEntry *e) {
+  if (e->status > 0 && e->pending == 0 && !is_top(self))
+    cache_remove(c, e);
+}
+
+/* Value of [op] on [a] and [b], '-' negates [a] alone. Without --bigint it wraps around
+   like longs do, with it the result grows as much as it needs to. */
+Num apply_op(char op, Num a, Num b) {
+  Num r = {0};
+  if (!options.bigint)
+    r.val = (op == '+') ? a.val + b.val : ((op == '*') ? a.val * b.val : -a.val);
+  else if (((op == '+') ? num_add(a, b, &r) : ((op == '*') ? num_mul(a, b, &r) : num_neg(a, &r))) < 0)
+    looming_doom("BIGINT");
+  return r;
+}
+
+/* Value of [mes] which is no longer freed with the message */
+Num take_value(Mes *mes) {
+  Num val = mes->val;
+  mes->val.big = NULL;
+  return val;
+}
+
+void op_response(ParseTree self, QueryCache *c, Mes *mes, int from, int n) {
+  CacheEntry *e;
+  if (from < n) { //a query
+    if ((e = take_query(self, c, mes, from)) != NULL) { //know nothing, ask children
+      e->pending = 1 + (self->type == BINARY);
+      send_message(self->io->write_to_child[0], mes->i, 0, false);
+      if (self->type == BINARY)
+        send_message(self->io->write_to_child[1], mes->i, 0, false);
+    }
+  }
+  else if ((e = cache_find(c, mes->i)) != NULL) { //response of a child
+    e->pending--;
+    if (e->status < 0) {
+      if (mes->err) { // one of the subtrees cannot be comptued with given init list 
+        resolve(self, e, (Num) {0}, true);
+      }
+      else if (self->type == UNARY) {
+        resolve(self, e, apply_op('-', mes->val, mes->val), false);
+      }
+      else if (e->status == -2) {
+        resolve(self, e, apply_op(self->label.op, e->val, mes->val), false);
+      }
+      else {
+        e->status = -2;
+        e->val = take_value(mes);
+      }
+    }
+    settle(self, c, e);
+  }
+}
+
+void var_response(ParseTree self, QueryCache *c, Mes *mes, int from, int n) {
+  CacheEntry *e;
+  if (from < n) { //a query
+    if ((e = take_query(self, c, mes, from)) != NULL) { //know nothing, ask circuit
+      e->pending = 1;
+      TRACE('b', "circuit", mes->i);
+      send_message(self->io->var_write_to_circuit, mes->i, 0, false);
+    }
+  }
+  else if ((e = cache_find(c, mes->i)) != NULL) {
+    e->pending--;
+    if (e->status == -1) { //circuit response
+      TRACE('e', "circuit", mes->i);
       if (!mes->err) {
-        broadcast(self, x, cache_status, cached, mes->i, mes->val, false);
+        resolve(self, e, take_value(mes), false);
+      }
+      else { //there was no value in the init list for this variable
+        ParseTree treevar = tree_of(self->label.var);
+        if (treevar == NULL) {
+          resolve(self, e, (Num) {0}, true);
+        }
+        else {
+          e->status = -2;
+          e->pending = 1;
+          TRACE('b', "root", mes->i);
+          send_message(treevar->io->clients[self->io->pipe_id].var_write_to_root, mes->i, 0, false);
+        }
+      }
+    }
+    else if (e->status == -2) { //response from root repesenting var's label
+      TRACE('e', "root", mes->i);
+      resolve(self, e, take_value(mes), mes->err);
+    }
+    settle(self, c, e);
+  }
+}
+
+/* Applies [code] to the values on top of [stack] of [top] values, returns the new top */
+size_t stack_apply(Num *stack, size_t top, OpCode code) {
+  size_t a = (code == OP_NEG) ? top-1 : top-2;
+  Num r = apply_op((code == OP_NEG) ? '-' : ((code == OP_ADD) ? '+' : '*'), stack[a], stack[top-1]);
+  free(stack[a].big);
+  if (a != top-1)
+    free(stack[top-1].big);
+  stack[a] = r;
+  return a + 1;
+}
+
+/* Runs the code of [u] on [vals] of its inputs */
+Num unit_eval(Unit *u, Num *vals) {
+  Num *stack = units.stack;
+  size_t top = 0;
+  for (size_t pc=0; pc<u->code_len; pc++) {
+    Instr *instr = &u->code[pc];
+    switch (instr->code) {
+      case OP_NUM:
+        stack[top++] = (Num) {instr->num, NULL};
+        break;
+      case OP_VAR:
+        if (num_copy(vals[instr->var], &stack[top++]) < 0)
+          looming_doom("BIGINT");
+        break;
+      case OP_NEG:
+      case OP_ADD:
+      case OP_MUL:
+        top = stack_apply(stack, top, instr->code);
+        break;
+      case OP_SAVE:
+        if (num_copy(stack[top-1], &units.slots[instr->var]) < 0)
+          looming_doom("BIGINT");
+        break;
+      case OP_LOAD:
+        if (num_copy(units.slots[instr->var], &stack[top++]) < 0)
+          looming_doom("BIGINT");
+        break;
+    }
+  }
+  for (int j=0; j<u->slots; j++) {
+    free(units.slots[j].big);
+    units.slots[j].big = NULL;
+  }
+  return stack[0];
+}
+
+/* Sends answer of [e] to the one who asks unit [u]: circuit asks equations, a piece is
+   asked by the process of the unit above it */
+void unit_reply(int u, CacheEntry *e) {
+  UnitProc *proc = &units.procs[units.list[u].proc];
+  if (units.list[u].top->is_root)
+    send_at(proc->write, e->i, 2*u, e->val, e->status == 1);
+  else
+    send_value(proc->parent_write, e->i, e->val, e->status == 1);
+}
+
+void unit_resolve(int u, CacheEntry *e, Num val, bool err) {
+  TRACE('e', "query", e->i);
+  e->status = err ? 1 : 2;
+  drop_vals(&units.caches[u], e);
+  e->val = val;
+  unit_reply(u, e);
+}
+
+/* Drops the entry once no more answers of inputs are coming, equations keep it for the
+   var leaves which may ask late */
+void unit_settle(int u, CacheEntry *e) {
+  if (e->status > 0 && e->pending == 0 && !units.list[u].top->is_root)
+    cache_remove(&units.caches[u], e);
+}
+
+/* Query goes to all the inputs of [u] at once, the value is computed when all of them
+   answered and F is sent as soon as one of them fails. Var leaves ask the circuit, which
+   also asks the equation of their variable when init list has no value. */
+void unit_query(int u, int i) {
+  Unit *unit = &units.list[u];
+  CacheEntry *e = cache_find(&units.caches[u], i);
+  if (e != NULL) { //circuit asks equation again once it has answered, never while in flight
+    counters.cache_hits++;
+    if (e->status > 0)
+      unit_reply(u, e);
+    return;
+  }
+  e = cache_add(&units.caches[u], i);
+  e->status = -1;
+  e->pending = unit->inputs_len;
+  TRACE('b', "query", i);
+  if (unit->inputs_len == 0) {
+    unit_resolve(u, e, unit_eval(unit, NULL), false);
+    unit_settle(u, e);
+    return;
+  }
+  if ((e->vals = calloc(unit->inputs_len, sizeof(*e->vals))) == NULL)
+    looming_doom("UNIT VALS");
+  for (int k=0; k<unit->inputs_len; k++) {
+    UnitInput *in = &unit->inputs[k];
+    if (in->var >= 0)
+      send_at(units.procs[unit->proc].write, i, 2*in->at + 1, (Num) {in->var, NULL}, false);
+    else
+      send_message(in->write, i, 0, false);
+  }
+}
+
+/* Takes answer of input [k] of [u] */
+void unit_answer(int u, int k, Mes *mes) {
+  CacheEntry *e = cache_find(&units.caches[u], mes->i);
+  if (e == NULL)
+    return;
+  e->pending--;
+  if (e->status < 0) {
+    if (mes->err) {
+      unit_resolve(u, e, (Num) {0}, true);
+    }
+    else {
+      e->vals[k] = take_value(mes);
+      if (e->pending == 0)
+        unit_resolve(u, e, unit_eval(&units.list[u], e->vals), false);
+    }
+  }
+  unit_settle(u, e);
+}
+
+/* Serves units of process [p] until the circuit or the process above is gone. Descriptors
+   table: [process above][circuit][pieces below]. Circuit's messages carry twice the unit
+   for queries of equations and twice the number of var leaf plus one for its values. */
+void serve_units(int p) {
+  UnitProc *proc = &units.procs[p];
+  EventLoop loop;
+  Mes message;
+  size_t code_len = 0, inputs = 0;
+  int slots = 0, pieces = 0;
+  for (int u=proc->unit; u<proc->unit + proc->units; u++) {
+    Unit *unit = &units.list[u];
+    units.caches[u].vals_len = unit->inputs_len;
+    code_len = (unit->code_len > code_len) ? unit->code_len : code_len;
+    slots = (unit->slots > slots) ? unit->slots : slots;
+    inputs += unit->inputs_len;
+  }
+  units.stack = calloc(code_len + 1, sizeof(*units.stack));
+  units.slots = calloc(slots + 1, sizeof(*units.slots));
+  units.leaves = calloc(proc->leaves + 1, sizeof(*units.leaves));
+  units.pieces = calloc(inputs - proc->leaves + 1, sizeof(*units.pieces));
+  int *fds = calloc(inputs - proc->leaves + 2, sizeof(*fds));
+  if (units.stack == NULL || units.slots == NULL || units.leaves == NULL || units.pieces == NULL || fds == NULL)
+    looming_doom("SERVE UNITS");
+  fds[0] = proc->parent_read;
+  fds[1] = proc->read;
+  for (int u=proc->unit; u<proc->unit + proc->units; u++) {
+    for (int k=0; k<units.list[u].inputs_len; k++) {
+      UnitInput *in = &units.list[u].inputs[k];
+      if (in->var >= 0) {
+        units.leaves[in->at] = (InputRef) {u, k};
+      }
+      else {
+        units.pieces[pieces] = (InputRef) {u, k};
+        fds[2 + pieces++] = in->read;
+      }
+    }
+  }
+  if (tracing && units.list[proc->unit].top->is_root)
+    trace_name("%d equation%s of %zu inputs", proc->units, (proc->units > 1) ? "s" : "", inputs);
+  else if (tracing)
+    trace_name("piece of %zu inputs", inputs);
+  loop_open(&loop, 2 + pieces);
+  for (int i=0; i<2 + pieces; i++) {
+    if (fds[i] >= 0)
+      loop_add(&loop, fds[i], i);
+  }
+  bool finish = false;
+  int ret;
+  ssize_t len;
+  int newest = -1; //the latest query seen, streamed batches before its one are over
+  while (!finish) {
+    for (int u=proc->unit; options.stream && u<proc->unit + proc->units; u++) {
+      if (units.caches[u].len > 2*options.window)
+        cache_forget(&units.caches[u], newest - options.window);
+    }
+    if ((ret = loop_wait(&loop)) < 0)
+      looming_doom("POLL READ UNITS");
+    for (int k=0; k<ret; k++) {
+      int i = loop.events[k].data.u32;
+      if (loop.events[k].events & EPOLLHUP)
+        finish = true; //pipe is closed
+      if ((len = receive_messages(fds[i])) == -1)
+        looming_doom("READ IN UNITS");
+      if (len == 0)
+        finish = true;
+      while (next_message(fds[i], &message)) {
+        if (message.i > newest)
+          newest = message.i;
+        if (i == 0) {
+          unit_query(proc->unit, message.i);
+        }
+        else if (i == 1 && message.at % 2 == 0) {
+          unit_query(message.at / 2, message.i);
+        }
+        else {
+          InputRef ref = (i == 1) ? units.leaves[message.at / 2] : units.pieces[i - 2];
+          unit_answer(ref.unit, ref.input, &message);
+        }
+        if (message.val.big != NULL)
+          free(message.val.big);
+      }
+    }
+  }
+  while (!flush_messages()) {
+    if (loop_wait(&loop) < 0)
+      looming_doom("POLL FLUSH UNITS");
+  }
+  loop_close(&loop);
+  for (int u=proc->unit; u<proc->unit + proc->units; u++)
+    free_cache(&units.caches[u]);
+  free(fds);
+}
+
+void listen(ParseTree self) {
+  QueryCache cache = {0};
+  EventLoop loop;
+  Mes message;
+  //descriptors table: [parentNode][pipes from clients if you are a top node][var/opartor pipes]
+  size_t n=1;
+  if (is_top(self)) {
+    n += self->io->pipes_counter;
+  }
+  int oftype = 0;
+  int *fds = calloc(n+2, sizeof(*fds));
+  if (fds == NULL)
+    looming_doom("LISTEN FDS");
+  fds[0] = self->io->read_from_parent;
+  for (int i=0; i<self->io->pipes_counter; i++) {
+    fds[i+1] = self->io->clients[i].root_read_from_var;
+  }
+  if (self->type == BINARY || self->type == UNARY) {
+    fds[n+(oftype++)] = self->io->read_from_child[0];
+    if (self->type == BINARY) {
+      fds[n+(oftype++)] = self->io->read_from_child[1];
+    }
+  }
+  else if (self->type == VAR) {
+    fds[n+(oftype++)] = self->io->var_read_from_circuit;
+    ParseTree treevar = tree_of(self->label.var);
+    if (treevar != NULL) {
+      fds[n+(oftype++)] = treevar->io->clients[self->io->pipe_id].var_read_from_root;
+    }
+  }
+  loop_open(&loop, n+oftype);
+  for (int i=0; i<n+oftype; i++)
+    loop_add(&loop, fds[i], i);
+  bool finish = false;
+  int ret;
+  ssize_t len;
+  int newest = -1; //the latest query seen, streamed batches before its one are over
+  while (!finish) {
+    if (options.stream && is_top(self) && cache.len > 2*options.window)
+      cache_forget(&cache, newest - options.window);
+    if ((ret = loop_wait(&loop)) < 0) {
+      looming_doom ("POLL READ CHILD");
+    }
+    for (int k=0; k<ret; k++) {
+      int i = loop.events[k].data.u32;
+      if (loop.events[k].events & EPOLLHUP) {
+        finish = true; //pipe is closed
+      }
+      if ((len = receive_messages(fds[i])) == -1)
+        looming_doom("READ IN CHILD");
+      if (len == 0) {
+        finish = true;
+      }
+      while (next_message(fds[i], &message)) {
+        if (message.i > newest)
+          newest = message.i;
+        switch(self->type) {
+          case PNUM:
+            pnum_response(self, message.i, i);
+            break;
+          case VAR:
+            var_response(self, &cache, &message, i, n);
+            break;
+          case BINARY:
+          case UNARY:
+            op_response(self, &cache, &message, i, n);
+            break;
+          default:
+            looming_doom("NODE TYPE ERR");
+        }
+        if (message.val.big != NULL)
+          free(message.val.big);
+      }
+    }
+  }
+  while (!flush_messages()) {
+    if (loop_wait(&loop) < 0)
+      looming_doom("POLL FLUSH CHILD");
+  }
+  loop_close(&loop);
+  free(fds);
+  free_cache(&cache);
+}
+
+/* Marks nodes of equation [top] collapsed into the unit of their parent unless their
+   uncollapsed subtree has at least [piece] nodes, these are listed in [pieces] unless it is
+   NULL. Shared nodes are neither cut off nor counted, they and what is below them belong
+   to every unit using them. Returns the size of what is left for top's unit or -1 on error */
+int cut_tree(ParseTree top, int *size, int piece, IntList *pieces) {
+  WalkStack st = {0};
+  if (walk_push(&st, top, NULL) < 0)
+    return -1;
+  while (st.len > 0) {
+    WalkFrame *f = &st.frames[st.len - 1];
+    ParseTree t = f->node;
+    int children = 2*(t->type == BINARY) + (t->type == UNARY);
+    if (f->state < children) {
+      ParseTree child = (f->state++ == 0) ? t->right : t->left;
+      if (!is_top(child) && walk_push(&st, child, NULL) < 0) {
+        free(st.frames);
+        return -1;
+      }
+    }
+    else {
+      st.len--;
+      size[t->id] = 1;
+      for (int i=0; i<children; i++) {
+        ParseTree child = (i == 0) ? t->right : t->left;
+        if (!is_top(child) && child->io->collapsed)
+          size[t->id] += size[child->id];
+      }
+      t->io->collapsed = (t != top && size[t->id] < piece);
+      if (t != top && !t->io->collapsed && pieces != NULL && intlist_push(pieces, t->id) < 0) {
+        free(st.frames);
+        return -1;
+      }
+    }
+  }
+  free(st.frames);
+  return size[top->id];
+}
+
+int unit_emit(Unit *u, Instr instr) {
+  if (u->code_len == u->code_cap) {
+    size_t nsize = (u->code_cap == 0) ? 16 : 2*u->code_cap;
+    Instr *ncode = (Instr *) realloc(u->code, sizeof(*u->code) * nsize);
+    if (ncode == NULL)
+      return -1;
+    u->code = ncode;
+    u->code_cap = nsize;
+  }
+  u->code[u->code_len++] = instr;
+  return 0;
+}
+
+/* Adds input of var leaf labeled [var] numbered [at] or, if [var] is -1, of piece [at]
+   and emits the code pushing its value */
+int unit_input(Unit *u, int var, int at) {
+  if (u->inputs_len == u->inputs_cap) {
+    size_t nsize = (u->inputs_cap == 0) ? 8 : 2*u->inputs_cap;
+    UnitInput *ninputs = (UnitInput *) realloc(u->inputs, sizeof(*u->inputs) * nsize);
+    if (ninputs == NULL)
+      return -1;
+    u->inputs = ninputs;
+    u->inputs_cap = nsize;
+  }
+  u->inputs[u->inputs_len] = (UnitInput) {var, at, -1, -1};
+  Instr instr = {.code = OP_VAR, .var = u->inputs_len++};
+  return unit_emit(u, instr);
+}
+
+/* Compiles [u], left subtree first like the in-process engine. A shared member is computed
+   where it's met first and loaded from its slot afterwards. */
+int compile_unit(Unit *u) {
+  WalkStack st = {0};
+  IntList saved = {0}; //members given slots, which are only good in this unit
+  int ret = walk_push(&st, u->top, NULL);
+  while (ret == 0 && st.len > 0) {
+    WalkFrame *f = &st.frames[st.len - 1];
+    ParseTree t = f->node;
+    Instr instr = {0};
+    if (f->state == 0 && t->io->slot >= 0) { //compiled before
+      st.len--;
+      instr = (Instr) {.code = OP_LOAD, .var = t->io->slot};
+      ret = unit_emit(u, instr);
+    }
+    else if (f->state == 0 && t != u->top && t->io->unit >= 0) { //piece of its own
+      st.len--;
+      ret = unit_input(u, -1, t->io->unit);
+    }
+    else if (f->state < 2*(t->type == BINARY) + (t->type == UNARY)) {
+      ParseTree child = (t->type == BINARY && f->state == 0) ? t->left : t->right;
+      f->state++;
+      ret = walk_push(&st, child, NULL);
+    }
+    else {
+      st.len--;
+      if (t->type == VAR) {
+        ret = unit_input(u, t->label.var, units.procs[u->proc].leaves++);
+      }
+      else {
+        instr.code = (t->type == PNUM) ? OP_NUM : ((t->type == UNARY) ? OP_NEG : ((t->label.op == '+') ? OP_ADD : OP_MUL));
+        instr.num = (t->type == PNUM) ? t->label.num : 0;
+        ret = unit_emit(u, instr);
+      }
+      if (ret == 0 && !t->is_root && t->parents > 1) {
+        instr = (Instr) {.code = OP_SAVE, .var = t->io->slot = u->slots++};
+        if (intlist_push(&saved, t->id) < 0 || unit_emit(u, instr) < 0)
+          ret = -1;
+      }
+    }
+  }
+  for (int j=0; j<saved.len; j++)
+    circuit.variables[saved.list[j]]->io->slot = -1;
+  free(saved.list);
+  free(st.frames);
+  return ret;
+}
+
+/* Splits what x[0] depends on into units and decides which processes evaluate them, so
+   that there are at most options.max_procs of them. While the budget lasts, equations get
+   processes of their own and what is left is shared by their trees in proportion to their
+   sizes, each tree is cut bottom up into pieces no smaller than its size divided by its
+   share. Otherwise equations share processes, in topological order with about the same
+   number of nodes each. */
+void plan_units() {
+  int *size = calloc(circuit.list_len + 1, sizeof(int));
+  long *tree_size = calloc(circuit.tops_len + 1, sizeof(long));
+  IntList pieces = {0};
+  if (size == NULL || tree_size == NULL)
+    looming_doom("PLAN UNITS");
+  for (int i=0; i<circuit.list_len; i++)
+    circuit.io[i].unit = circuit.io[i].slot = -1;
+  long total = 0;
+  for (int t=0; t<circuit.tops_len; t++) {
+    if ((tree_size[t] = cut_tree(circuit.tops[t], size, INT_MAX, NULL)) < 0)
+      looming_doom("PLAN UNITS");
+    total += tree_size[t];
+  }
+  long extra = options.max_procs - (long) circuit.tops_len;
+  for (int t=0; extra > 0 && t<circuit.tops_len; t++) {
+    long share = (total > circuit.tops_len) ? 1 + extra * (tree_size[t] - 1) / (total - circuit.tops_len) : 1;
+    int piece = (share > 1) ? tree_size[t] / (share - 1) + 1 : INT_MAX;
+    if (cut_tree(circuit.tops[t], size, piece, &pieces) < 0)
+      looming_doom("PLAN UNITS");
+  }
+  units.len = circuit.tops_len + pieces.len;
+  units.list = calloc(units.len + 1, sizeof(*units.list));
+  units.procs = calloc(units.len + 1, sizeof(*units.procs));
+  units.caches = calloc(units.len + 1, sizeof(*units.caches));
+  if (units.list == NULL || units.procs == NULL || units.caches == NULL)
+    looming_doom("PLAN UNITS");
+  long before = 0, last = -1; //nodes of the equations placed so far and share of the last one
+  for (int t=0; t<circuit.tops_len; t++) {
+    long p = (extra >= 0) ? t : before * options.max_procs / total;
+    if (p != last) //a huge equation may take a few shares, they are not left empty
+      units.procs[units.procs_len++].unit = t;
+    last = p;
+    units.list[t].proc = units.procs_len - 1;
+    units.procs[units.procs_len - 1].units++;
+    units.list[t].top = circuit.tops[t];
+    circuit.tops[t]->io->unit = t;
+    before += tree_size[t];
+  }
+  for (int j=0; j<pieces.len; j++) {
+    int u = circuit.tops_len + j;
+    units.list[u] = (Unit) {.top = circuit.variables[pieces.list[j]], .proc = units.procs_len};
+    units.procs[units.procs_len++] = (UnitProc) {.unit = u, .units = 1};
+    units.list[u].top->io->unit = u;
+  }
+  for (int u=0; u<units.len; u++) {
+    if (compile_unit(&units.list[u]) < 0)
+      looming_doom("COMPILE UNIT");
+  }
+  free(size);
+  free(tree_size);
+  free(pieces.list);
+}
+
+/* Names the process of [self] in the trace after the node it evaluates */
+void name_process(ParseTree self) {
+  const char *kind = is_top(self) ? "top " : "";
+  if (self->type == VAR)
+    trace_name("%sx[%d]", kind, self->label.var);
+  else if (self->type == PNUM)
+    trace_name("%s%ld", kind, self->label.num);
+  else
+    trace_name("%s%c", kind, self->label.op);
+}
+
+/* [self] is a top node: root of some equation or node shared by many parents */
+void processes_tree(ParseTree self) {
+  //Tree of self defienietly doesn't need other tops' descriptors to write to their clients
+  for (int k=0; k<circuit.tops_len; k++) {
+    ParseTree top = circuit.tops[k];
+    if (top == self) {
+      continue;
+    }
+    for(int j=0; j<top->io->pipes_counter; j++) {
+      if (close(top->io->clients[j].root_write_to_var) < 0 || close(top->io->clients[j].root_read_from_var) < 0)
+        looming_doom("CLOSE WRITE PIPES FOR OTHER ROOTS");
+    }
+  }
+  //So now create the processes tree mapping ParseTree of self, shared children are forked by circuit
+  IntList forked = {0}; //this process' ends of pipes to the children it forked
+  WalkStack st = {0};
+  int w_to_c[2], w_to_p[2];
+  if (walk_push(&st, self, NULL) < 0)
+    looming_doom("PROCESSES TREE");
+  while (st.len > 0) {
+    ParseTree node = st.frames[--st.len].node;
+    for (int i=0; i<2*(node->type == BINARY) + (node->type == UNARY); i++) {
+      ParseTree child = (i==0) ? node->right : node->left;
+      if (is_top(child))
+        continue;
+      if (open_channel(w_to_c) < 0 || open_channel(w_to_p) < 0) {
+        looming_doom("PIPES BETWEEN TREE NODES");
+      }
+      switch (fork()) {
+        case -1:
+          looming_doom("FORK IN PROC_NODE");
+        case 0:
+          trace_child();
+          if (is_top(self)) { //you're children, dispose top desc
+            for (int j=0; j<self->io->pipes_counter; j++) {
+              if (close(self->io->clients[j].root_write_to_var) < 0 || close(self->io->clients[j].root_read_from_var) < 0)
+                looming_doom("CLOSE WRITE TO VARS IN NONROOT");
+            }
+          }
+          // close pipes to grandparent and to the siblings forked before
+          close_pipe_or_perish_any_hope(self->io->read_from_parent, "GRANDP");
+          close_pipe_or_perish_any_hope(self->io->write_to_parent, "GRANDP");
+          for (int j=0; j<forked.len; j++)
+            close_pipe_or_perish_any_hope(forked.list[j], "SIBLING");
+          forked.len = 0;
+          self = child;
+          self->io->read_from_parent = w_to_c[0];
+          self->io->write_to_parent = w_to_p[1];
+          close_pipe_or_perish_any_hope(w_to_p[0], "CHILD PARENT");
+          close_pipe_or_perish_any_hope(w_to_c[1], "CHILD PARENT W");
+          st.len = 0;
+          if (walk_push(&st, self, NULL) < 0)
+            looming_doom("PROCESSES TREE");
+          node = NULL;
+          break;
+        default:
+          node->io->read_from_child[i] = w_to_p[0];
+          node->io->write_to_child[i] = w_to_c[1];
+          if (intlist_push(&forked, w_to_p[0]) < 0 || intlist_push(&forked, w_to_c[1]) < 0)
+            looming_doom("PROCESSES TREE");
+          close_pipe_or_perish_any_hope(w_to_c[0], "FROM PARENT WITH ERROR");
+          close_pipe_or_perish_any_hope(w_to_p[1], "FROM PARENT WITH ERROR W");
+      }
+      if (node == NULL)
+        break;
+    }
+  }
+  free(st.frames);
+  self->visited = true;
+  if (tracing)
+    name_process(self);
+  //we have the whole tree, so all 'to be propagated' pipes reached thier destination;
+  //close copies that missed the point
+  for (int i=0; i<circuit.list_len; i++) {
+    ParseTree node = circuit.variables[i];
+    if (node->type == VAR && node->io->needed && !node->visited) {
+      close_pipe_or_perish_any_hope(node->io->var_write_to_circuit, "UNNEC VAR CIRC");
+      close_pipe_or_perish_any_hope(node->io->var_read_from_circuit, "UNNEC VAR CIRC R");
+    } 
+  }
+  for (int k=0; k<circuit.tops_len; k++) {
+    ParseTree node = circuit.tops[k];
+    for (int i=0; i<node->io->pipes_counter; i++) {
+      if (node->io->clients[i].client->visited)
+        continue;
+      close_pipe_or_perish_any_hope(node->io->clients[i].var_write_to_root, "UNNEC TO ROOT");
+      close_pipe_or_perish_any_hope(node->io->clients[i].var_read_from_root, "UNNEC TO ROOT R");
+    }
+  }
+  listen(self);
+  for (int i=0; i < 2*(self->type == BINARY) + (self->type == UNARY); i++)
+    close(self->io->write_to_child[i]);
+  for (int i=0; i < forked.len/2; i++) {
+    if (wait(0) == -1)
+      looming_doom("WAIT ERR");
+  }
+  free(forked.list);
+  looming_doom(NULL);
+}
+
+typedef struct {
+  int var;
+  int val;
+  int seq; //position in the line
+} Assignment;
+
+int cmp_assignment(const void *a, const void *b) {
+  const Assignment *l = a, *r = b;
+  if (l->var != r->var)
+    return (l->var < r->var) ? -1 : 1;
+  return l->seq - r->seq;
+}
+
+/* Value of x[v] given in init list of query [i] or INFINITY if there is none */
+int init_value(int i, int v) {
+  size_t lo = init.row[i], hi = init.row[i+1];
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (init.var[mid] < v)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo < init.row[i+1] && init.var[lo] == v) ? init.val[lo] : INFINITY;
+}
+
+/* Appends sorted assignments of one line to [init], returns -1 if some variable is
+   given twice or memory runs out */
+int push_init_row(Assignment *row, size_t len) {
+  qsort(row, len, sizeof(*row), cmp_assignment);
+  for (size_t j=0; j<len; j++) {
+    if (j+1 < len && row[j+1].var == row[j].var) {
+      if (row[j].val < INFINITY) //only a value that was not given may be given again
+        return -1;
+      continue;
+    }
+    if (init.len == init.cap) {
+      size_t nsize = (init.cap == 0) ? 1024 : 2*init.cap;
+      int *nvar = (int *) realloc(init.var, sizeof(*init.var) * nsize);
+      if (nvar == NULL)
+        return -1;
+      init.var = nvar;
+      int *nval = (int *) realloc(init.val, sizeof(*init.val) * nsize);
+      if (nval == NULL)
+        return -1;
+      init.val = nval;
+      init.cap = nsize;
+    }
+    init.var[init.len] = row[j].var;
+    init.val[init.len++] = row[j].val;
+  }
+  return 0;
+}
+
+/* Reads the next batch of [count] init lists into [init], replacing the previous one */
+void read_init_lists(int count) {
+  char *line;
+  char *err = NULL;
+  static Assignment *row = NULL;
+  static size_t row_len, row_cap = 0;
+  if (init.labels == NULL) { //the first batch is the largest one
+    init.labels = calloc(count + 1, sizeof(int));
+    init.row = calloc(count + 1, sizeof(size_t));
+    if (init.labels == NULL || init.row == NULL)
+      looming_doom("VARS");
+  }
+  init.base = init.lines;
+  init.len = 0;
+  for (int i=0; i<count && err == NULL; i++) {
+    if (input_int(&nr) < 0 || (line = input_line()) == NULL) {
+      err = "GETLINE 2";
+      break;
+    }
+    init.labels[i] = nr;
+    char *mock_line = line;
+    row_len = 0;
+    while (*mock_line != '\n' && err == NULL) {
+      Label labell;
+      NodeType nodetypel = retrieve_var(&mock_line, &labell); 
+      if (nodetypel != VAR) {
+        break;
+      }
+      Label labelr;
+      NodeType nodetyper = retrieve_var(&mock_line, &labelr); 
+      if (labell.var<0) {
+        err = "PARSING INIT LIST VAR";
+        break;
+      }
+      if (row_len == row_cap) {
+        row_cap = (row_cap == 0) ? 16 : 2*row_cap;
+        Assignment *nrow = (Assignment *) realloc(row, sizeof(*row) * row_cap);
+        if (nrow == NULL) {
+          err = "INIT ROW";
+          break;
+        }
+        row = nrow;
+      }
+      row[row_len] = (Assignment) {labell.var, labelr.num, row_len};
+      row_len++;
+      while (is_blank(*mock_line)) {
+        ++(mock_line); 
+      }
+    }
+    if (err == NULL && push_init_row(row, row_len) < 0)
+      err = "PARSING INIT LIST VAR";
+    init.row[i+1] = init.len;
+    if (err != NULL) {
+      free(row);
+      looming_doom(err);
+    }
+  }
+  init.lines += count;
+  if (init.lines == N-K)
+    free(row);
+}
+
+int emit(Instr instr) {
+  if (program.len == program.cap) {
+    size_t nsize = (program.cap == 0) ? 64 : 2*program.cap;
+    Instr *ncode = (Instr *) realloc(program.code, sizeof(*program.code) * nsize);
+    if (ncode == NULL)
+      return -1;
+    program.code = ncode;
+    program.cap = nsize;
+  }
+  program.code[program.len++] = instr;
+  return 0;
+}
+
+/* Emits code of a single node whose children are already compiled, [dl] and [dr] are stack
+   depths they need. Returns depth the node needs or -1 on error. */
+int compile_node(ParseTree tree, int dl, int dr) {
+  Instr instr = {0};
+  int depth;
+  switch (tree->type) {
+    case PNUM:
+      instr.code = OP_NUM;
+      instr.num = tree->label.num;
+      depth = 1;
+      break;
+    case VAR:
+      instr.code = OP_VAR;
+      instr.var = tree->label.var;
+      instr.tree = (tree_of(tree->label.var) != NULL) ? tree_of(tree->label.var)->post : -1;
+      depth = 1;
+      break;
+    case BINARY:
+    case UNARY:
+      instr.code = (tree->type == UNARY) ? OP_NEG : ((tree->label.op == '+') ? OP_ADD : OP_MUL);
+      depth = (dl > dr + (tree->type == BINARY)) ? dl : dr + (tree->type == BINARY);
+      break;
+    default:
+      return -1;
+  }
+  if (emit(instr) < 0)
+    return -1;
+  if (!tree->is_root && tree->parents > 1) {
+    instr = (Instr) {0};
+    instr.code = OP_SAVE;
+    instr.var = tree->slot = program.slots++;
+    if (emit(instr) < 0)
+      return -1;
+  }
+  return depth;
+}
+
+/* Emits postfix code of [tree], returns stack depth needed to evaluate it or -1 on error.
+   Shared node is compiled where it's met first, following occurrences load its value. */
+int compile_tree(ParseTree tree) {
+  WalkStack st = {0};
+  int depth = 0; //of the node compiled last
+  if (walk_push(&st, tree, NULL) < 0)
+    return -1;
+  while (depth >= 0 && st.len > 0) {
+    WalkFrame *f = &st.frames[st.len - 1];
+    ParseTree t = f->node;
+    if (t->slot >= 0) { //compiled before
+      Instr instr = {.code = OP_LOAD, .var = t->slot};
+      depth = (emit(instr) < 0) ? -1 : 1;
+      st.len--;
+    }
+    else if (f->state == 0 && t->type == BINARY) {
+      f->state = 1;
+      if (walk_push(&st, t->left, NULL) < 0)
+        depth = -1;
+    }
+    else if (f->state < 2 && (t->type == BINARY || t->type == UNARY)) {
+      f->depth = (f->state == 1) ? depth : 0;
+      f->state = 2;
+      if (walk_push(&st, t->right, NULL) < 0)
+        depth = -1;
+    }
+    else {
+      depth = compile_node(t, f->depth, depth);
+      st.len--;
+    }
+  }
+  free(st.frames);
+  return depth;
+}
+
+int compile_program() {
+  program.tree_end = (size_t *) calloc(circuit.topo_ord_len, sizeof(*program.tree_end));
+  if (program.tree_end == NULL)
+    return -1;
+  for (int k=0; k<circuit.topo_ord_len; k++) {
+    int depth = compile_tree(tree_of(circuit.topo_ord[k]));
+    if (depth < 0)
+      return -1;
+    if (depth > program.depth)
+      program.depth = depth;
+    program.tree_end[k] = program.len;
+  }
+  return 0;
+}
+
+EvalState *new_eval_state() {
+  EvalState *st = calloc(1, sizeof(*st));
+  if (st == NULL)
+    return NULL;
+  st->trees = calloc(circuit.topo_ord_len, sizeof(Lanes));
+  st->stack = calloc(program.depth, sizeof(Lanes));
+  st->slots = calloc(program.slots + 1, sizeof(Lanes));
+  if (st->trees == NULL || st->stack == NULL || st->slots == NULL)
+    return NULL;
+  return st;
+}
+
+void free_eval_state(EvalState *st) {
+  free(st->trees);
+  free(st->stack);
+  free(st->slots);
+  free(st);
+}
+
+/* Runs the program up to the tree [last] for [cnt] (at most LANES) queries listed in
+   [queries], results of trees land in [st] */
+void run_program(int *queries, int cnt, int last, EvalState *st) {
+  Lanes *stack = st->stack;
+  size_t pc = 0;
+  for (int k=0; k<=last; k++) {
+    size_t top = 0;
+    for (; pc<program.tree_end[k]; pc++) {
+      Instr *instr = &program.code[pc];
+      Lanes *a = top > 0 ? &stack[top-1] : NULL, *b = &stack[top];
+      switch (instr->code) {
+        case OP_NUM:
+          for (int l=0; l<LANES; l++)
+            b->val[l] = instr->num;
+          b->err = b->over = 0;
+          top++;
+          break;
+        case OP_VAR:
+          b->err = b->over = 0;
+          for (int l=0; l<cnt; l++) {
+            if ((b->val[l] = init_value(queries[l], instr->var)) >= INFINITY) {
+              if (instr->tree >= 0) {
+                b->val[l] = st->trees[instr->tree].val[l];
+                b->err |= st->trees[instr->tree].err & (1ull << l);
+                b->over |= st->trees[instr->tree].over & (1ull << l);
+              }
+              else {
+                b->val[l] = 0;
+                b->err |= 1ull << l;
+              }
+            }
+          }
+          top++;
+          break;
+        case OP_NEG:
+          if (options.bigint) {
+            for (int l=0; l<LANES; l++)
+              a->over |= (uint64_t) (a->val[l] == LONG_MIN) << l;
+          }
+          for (int l=0; l<LANES; l++)
+            a->val[l] = -a->val[l];
+          break;
+        case OP_ADD:
+          a = &stack[top-2];
+          b = &stack[top-1];
+          if (options.bigint) {
+            for (int l=0; l<LANES; l++)
+              a->over |= (uint64_t) __builtin_add_overflow(a->val[l], b->val[l], &a->val[l]) << l;
+          }
+          else {
+            for (int l=0; l<LANES; l++)
+              a->val[l] += b->val[l];
+          }
+          a->err |= b->err;
+          a->over |= b->over;
+          top--;
+          break;
+        case OP_MUL:
+          a = &stack[top-2];
+          b = &stack[top-1];
+          if (options.bigint) {
+            for (int l=0; l<LANES; l++)
+              a->over |= (uint64_t) __builtin_mul_overflow(a->val[l], b->val[l], &a->val[l]) << l;
+          }
+          else {
+            for (int l=0; l<LANES; l++)
+              a->val[l] *= b->val[l];
+          }
+          a->err |= b->err;
+          a->over |= b->over;
+          top--;
+          break;
+        case OP_SAVE:
+          st->slots[instr->var] = *a;
+          break;
+        case OP_LOAD:
+          *b = st->slots[instr->var];
+          top++;
+          break;
+      }
+    }
+    st->trees[k] = stack[0];
+  }
+}
+
+/* Evaluates the program up to the tree [last] for query [q] one value at a time, letting
+   values grow past longs. Only queries that overflowed in run_program get here. */
+Num eval_big(int q, int last) {
+  Num *trees = calloc(last + 1, sizeof(*trees));
+  Num *stack = calloc(program.depth + 1, sizeof(*stack));
+  Num *slots = calloc(program.slots + 1, sizeof(*slots));
+  if (trees == NULL || stack == NULL || slots == NULL)
+    looming_doom("BIGINT");
+  size_t pc = 0;
+  for (int k=0; k<=last; k++) {
+    size_t top = 0;
+    for (; pc<program.tree_end[k]; pc++) {
+      Instr *instr = &program.code[pc];
+      Num v = {0};
+      switch (instr->code) {
+        case OP_NUM:
+          stack[top++] = (Num) {instr->num, NULL};
+          break;
+        case OP_VAR: //a missing value fails the query, so it cannot be one that overflowed
+          v.val = init_value(q, instr->var);
+          if (v.val >= INFINITY)
+            v = (instr->tree >= 0) ? trees[instr->tree] : (Num) {0};
+          if (num_copy(v, &stack[top++]) < 0)
+            looming_doom("BIGINT");
+          break;
+        case OP_NEG:
+        case OP_ADD:
+        case OP_MUL:
+          top = stack_apply(stack, top, instr->code);
+          break;
+        case OP_SAVE:
+          free(slots[instr->var].big);
+          if (num_copy(stack[top-1], &slots[instr->var]) < 0)
+            looming_doom("BIGINT");
+          break;
+        case OP_LOAD:
+          if (num_copy(slots[instr->var], &stack[top++]) < 0)
+            looming_doom("BIGINT");
+          break;
+      }
+    }
+    trees[k] = stack[0];
+  }
+  Num answer = trees[last];
+  for (int k=0; k<last; k++)
+    free(trees[k].big);
+  for (int j=0; j<program.slots; j++)
+    free(slots[j].big);
+  free(trees);
+  free(stack);
+  free(slots);
+  return answer;
+}
+
+/* Blocks of queries owned by a worker, the owner takes them from the bottom,
+   the others steal from the top */
+typedef struct {
+  pthread_mutex_t lock;
+  int top;
+  int bottom; //blocks [top, bottom) are still waiting
+} Deque;
+
+/* Shared by all the workers of in-process engine */
+struct Pool {
+  Deque *deques;
+  int workers;
+  int *queries; //the ones x[0] is not given directly for
+  int cnt;
+  int last; //topo position of tree of x[0]
+  long *answers; //one per query
+  Big **bigs; //answers that did not fit into answers, only with --bigint
+  uint64_t *failed; //error mask per block
+} pool;
+
+/* Returns next block for worker [id], stealing from the others when its own deque is empty,
+   or -1 if there is nothing left. No blocks are added once workers run, so a sweep that
+   finds all deques empty is final */
+int next_block(int id) {
+  Deque *d = &pool.deques[id];
+  int block = -1;
+  pthread_mutex_lock(&d->lock);
+  if (d->top < d->bottom)
+    block = --d->bottom;
+  pthread_mutex_unlock(&d->lock);
+  for (int w=1; block < 0 && w<pool.workers; w++) {
+    d = &pool.deques[(id + w) % pool.workers];
+    pthread_mutex_lock(&d->lock);
+    if (d->top < d->bottom)
+      block = d->top++;
+    pthread_mutex_unlock(&d->lock);
+  }
+  return block;
+}
+
+void *worker(void *arg) {
+  int id = (int)(intptr_t)arg;
+  EvalState *st = new_eval_state();
+  if (st == NULL)
+    looming_doom("PROGRAM STACK");
+  int block;
+  while ((block = next_block(id)) >= 0) {
+    int q = block * LANES;
+    int lanes = (pool.cnt - q < LANES) ? pool.cnt - q : LANES;
+    run_program(pool.queries + q, lanes, pool.last, st);
+    memcpy(pool.answers + q, st->trees[pool.last].val, lanes * sizeof(long));
+    pool.failed[block] = st->trees[pool.last].err;
+    uint64_t over = options.bigint ? st->trees[pool.last].over & ~pool.failed[block] : 0;
+    for (int l=0; over != 0 && l<lanes; l++) {
+      if (over & (1ull << l)) {
+        Num answer = eval_big(pool.queries[q+l], pool.last);
+        pool.answers[q+l] = answer.val;
+        pool.bigs[q+l] = answer.big;
+      }
+    }
+  }
+  free_eval_state(st);
+  return NULL;
+}
+
+void print_answer(int label, Num val) {
+  if (val.big == NULL) {
+    printf("%d P %ld\n", label, val.val);
+  }
+  else {
+    printf("%d P ", label);
+    if (num_print(stdout, val) < 0)
+      looming_doom("PRINT BIGINT");
+    printf("\n");
+  }
+}
+
+/* Answers [count] queries of the batch without spawning any process, the order of answers
+   is the one processes tree gives when queries are resolved in order they were sent.
+   Blocks of queries are spread evenly over options.threads workers up front,
+   the ones that run out of work steal from the others. */
+void run_in_process(int count) {
+  if (program.tree_end == NULL && compile_program() < 0)
+    looming_doom("COMPILE PROGRAM");
+  pool.last = x0_tree;
+  pool.cnt = 0;
+  pool.queries = calloc(count + 1, sizeof(int));
+  pool.answers = calloc(count + 1, sizeof(long));
+  pool.bigs = options.bigint ? calloc(count + 1, sizeof(Big *)) : NULL;
+  if (pool.queries == NULL || pool.answers == NULL || (options.bigint && pool.bigs == NULL))
+    looming_doom("PROGRAM STACK");
+  for (int i=0; i<count; i++) {
+    if (init_value(i, 0) < INFINITY)
+      printf("%d P %d\n", init.labels[i], init_value(i, 0));
+    else
+      pool.queries[pool.cnt++] = i;
+  }
+  int blocks = (pool.cnt + LANES - 1) / LANES;
+  pool.workers = (options.threads < blocks) ? options.threads : blocks;
+  if (pool.workers < 1)
+    pool.workers = 1;
+  pool.failed = calloc(blocks + 1, sizeof(uint64_t));
+  pool.deques = calloc(pool.workers, sizeof(Deque));
+  pthread_t *threads = calloc(pool.workers, sizeof(pthread_t));
+  if (pool.failed == NULL || pool.deques == NULL || threads == NULL)
+    looming_doom("THREAD POOL");
+  for (int w=0; w<pool.workers; w++) {
+    pthread_mutex_init(&pool.deques[w].lock, NULL);
+    pool.deques[w].top = (long)blocks * w / pool.workers;
+    pool.deques[w].bottom = (long)blocks * (w+1) / pool.workers;
+  }
+  for (int w=1; w<pool.workers; w++) {
+    if (pthread_create(&threads[w], NULL, worker, (void *)(intptr_t)w) != 0)
+      looming_doom("THREAD CREATE");
+  }
+  worker((void *)0);
+  for (int w=1; w<pool.workers; w++) {
+    if (pthread_join(threads[w], NULL) != 0)
+      looming_doom("THREAD JOIN");
+  }
+  for (int q=0; q<pool.cnt; q++) {
+    if (pool.failed[q / LANES] & (1ull << (q % LANES)))
+      printf("%d F\n", init.labels[pool.queries[q]]);
+    else
+      print_answer(init.labels[pool.queries[q]], (Num) {pool.answers[q], options.bigint ? pool.bigs[q] : NULL});
+  }
+  for (int q=0; options.bigint && q<pool.cnt; q++)
+    free(pool.bigs[q]);
+  for (int w=0; w<pool.workers; w++)
+    pthread_mutex_destroy(&pool.deques[w].lock);
+  free(threads);
+  free(pool.deques);
+  free(pool.failed);
+  free(pool.answers);
+  free(pool.bigs);
+  free(pool.queries);
+}
+
+/* Nodes the value of [t] is computed from: children of operators and the tree of variable of
+   a var leaf, which gives its value when the init list does not */
+ParseTree delta_input(ParseTree t, int j) {
+  if (t->type == VAR)
+    return (j == 0) ? tree_of(t->label.var) : NULL;
+  if (t->type == UNARY)
+    return (j == 0) ? t->right : NULL;
+  if (t->type == BINARY)
+    return (j == 0) ? t->left : ((j == 1) ? t->right : NULL);
+  return NULL;
+}
+
+void delta_push(int k) {
+  if (delta.queued[k])
+    return;
+  delta.queued[k] = true;
+  int j = delta.heap_len++;
+  for (; j > 0 && delta.heap[(j-1)/2] > k; j = (j-1)/2)
+    delta.heap[j] = delta.heap[(j-1)/2];
+  delta.heap[j] = k;
+}
+
+int delta_pop() {
+  int k = delta.heap[0], last = delta.heap[--delta.heap_len];
+  int j = 0;
+  while (2*j + 1 < delta.heap_len) {
+    int c = 2*j + 1;
+    if (c+1 < delta.heap_len && delta.heap[c+1] < delta.heap[c])
+      c++;
+    if (delta.heap[c] >= last)
+      break;
+    delta.heap[j] = delta.heap[c];
+    j = c;
+  }
+  delta.heap[j] = last;
+  delta.queued[k] = false;
+  return k;
+}
+
+/* Orders nodes x[0] depends on and links each one to the ones computed from it, all of them
+   wait for the first query */
+void delta_open() {
+  int n = circuit.list_len;
+  delta.order = calloc(n + 1, sizeof(*delta.order));
+  delta.pos = malloc(sizeof(*delta.pos) * (n + 1));
+  delta.dep_start = calloc(n + 2, sizeof(*delta.dep_start));
+  delta.val = calloc(n + 1, sizeof(*delta.val));
+  delta.err = calloc(n + 1, sizeof(*delta.err));
+  delta.heap = calloc(n + 1, sizeof(*delta.heap));
+  delta.queued = calloc(n + 1, sizeof(*delta.queued));
+  if (delta.order == NULL || delta.pos == NULL || delta.dep_start == NULL || delta.val == NULL
+      || delta.err == NULL || delta.heap == NULL || delta.queued == NULL)
+    looming_doom("DELTA");
+  for (int i=0; i<n; i++)
+    delta.pos[i] = -1;
+  WalkStack st = {0};
+  if (walk_push(&st, tree_of(0), NULL) < 0)
+    looming_doom("DELTA");
+  delta.pos[tree_of(0)->id] = -2; //on the stack
+  while (st.len > 0) { //post-order over inputs, cycles were ruled out with equations
+    WalkFrame *f = &st.frames[st.len - 1];
+    ParseTree t = f->node;
+    if (f->state < 2) {
+      ParseTree in = delta_input(t, f->state++);
+      if (in != NULL && delta.pos[in->id] == -1) {
+        delta.pos[in->id] = -2;
+        if (walk_push(&st, in, NULL) < 0)
+          looming_doom("DELTA");
       }
-      else { //there was no value in the init list for this variable
-        ParseTree treevar = circuit.trees[self->label.var];
-        if (treevar == NULL) {
-          broadcast(self, x, cache_status, cached, mes->i, 0, true);
-        }
-        else {
-          cache_status[mes->i] = -2;
-          send_message(treevar->var_write_to_root[self->pipe_id], mes->i, 0, false);
-        }
+      continue;
+    }
+    st.len--;
+    delta.pos[t->id] = delta.len;
+    delta.order[delta.len++] = t;
+    if (t->type == VAR && var_entry(t->label.var, true) < 0)
+      looming_doom("DELTA");
+  }
+  free(st.frames);
+  delta.vars = circuit.table_len;
+  delta.leaf_start = calloc(delta.vars + 2, sizeof(*delta.leaf_start));
+  delta.cur = malloc(sizeof(*delta.cur) * (delta.vars + 1));
+  delta.given = calloc(delta.vars + 1, sizeof(*delta.given));
+  delta.seen = calloc(delta.vars + 1, sizeof(*delta.seen));
+  if (delta.leaf_start == NULL || delta.cur == NULL || delta.given == NULL || delta.seen == NULL)
+    looming_doom("DELTA");
+  for (int e=0; e<delta.vars; e++)
+    delta.cur[e] = INFINITY;
+  //both lists are counted first, then filled from the back of their ranges
+  for (int k=0; k<delta.len; k++) {
+    for (int j=0; j<2; j++) {
+      ParseTree in = delta_input(delta.order[k], j);
+      if (in != NULL)
+        delta.dep_start[delta.pos[in->id] + 1]++;
+    }
+    if (delta.order[k]->type == VAR)
+      delta.leaf_start[var_entry(delta.order[k]->label.var, false) + 1]++;
+  }
+  for (int k=0; k<delta.len; k++)
+    delta.dep_start[k+1] += delta.dep_start[k];
+  for (int e=0; e<delta.vars; e++)
+    delta.leaf_start[e+1] += delta.leaf_start[e];
+  delta.deps = calloc(delta.dep_start[delta.len] + 1, sizeof(*delta.deps));
+  delta.leaves = calloc(delta.leaf_start[delta.vars] + 1, sizeof(*delta.leaves));
+  if (delta.deps == NULL || delta.leaves == NULL)
+    looming_doom("DELTA");
+  int *dep_end = calloc(delta.len + 1, sizeof(int));
+  int *leaf_end = calloc(delta.vars + 1, sizeof(int));
+  if (dep_end == NULL || leaf_end == NULL)
+    looming_doom("DELTA");
+  for (int k=0; k<delta.len; k++) {
+    ParseTree t = delta.order[k];
+    for (int j=0; j<2; j++) {
+      ParseTree in = delta_input(t, j);
+      if (in != NULL) {
+        int p = delta.pos[in->id];
+        delta.deps[delta.dep_start[p] + dep_end[p]++] = k;
       }
     }
+    if (t->type == VAR) {
+      int e = var_entry(t->label.var, false);
+      delta.leaves[delta.leaf_start[e] + leaf_end[e]++] = k;
+    }
+    delta_push(k);
+  }
+  free(dep_end);
+  free(leaf_end);
+}
+
+/* Gives the variable of entry [e] value [val] of the current query, its leaves wait if it changes */
+void delta_assign(int e, int val) {
+  if (delta.cur[e] == val)
+    return;
+  delta.cur[e] = val;
+  for (int j=delta.leaf_start[e]; j<delta.leaf_start[e+1]; j++)
+    delta_push(delta.leaves[j]);
+}
+
+/* Computes node at position [k] from the values of its inputs */
+bool delta_eval(int k, Num *val) {
+  ParseTree t = delta.order[k];
+  *val = (Num) {0};
+  if (t->type == PNUM) {
+    val->val = t->label.num;
+    return false;
   }
-  else if (cache_status[mes->i] == -2) { //waiting for the response from root repesenting var's label
-    if (from == n+1) {
-      broadcast(self, x, cache_status, cached, mes->i, mes->val, mes->err);
+  if (t->type == VAR) {
+    int e = var_entry(t->label.var, false);
+    if (delta.cur[e] < INFINITY) {
+      val->val = delta.cur[e];
+      return false;
     }
+    ParseTree tree = tree_of(t->label.var);
+    if (tree == NULL)
+      return true;
+    int p = delta.pos[tree->id];
+    if (!delta.err[p] && num_copy(delta.val[p], val) < 0)
+      looming_doom("BIGINT");
+    return delta.err[p];
   }
+  int r = delta.pos[t->right->id];
+  int l = (t->type == BINARY) ? delta.pos[t->left->id] : r;
+  if (delta.err[r] || delta.err[l])
+    return true;
+  *val = apply_op((t->type == UNARY) ? '-' : t->label.op, delta.val[l], delta.val[r]);
+  return false;
 }
 
-void listen(ParseTree self, int x) {
-  int *cache_status = NULL;
-  long *cached = NULL;
-  struct pollfd *entries = NULL;
-  Mes message;
-  if (self->type != PNUM) {
-    cache_status = calloc(N-K, sizeof(int));
-    cached = calloc(N-K, sizeof(long));
-    if (cache_status == NULL || cached == NULL)
-      looming_doom("CACHE CALLOC");
+/* Answers query [i] of the batch, recomputing what depends on the changes since the last one */
+void delta_query(int i) {
+  int stamp = ++delta.queries;
+  for (size_t j=init.row[i]; j<init.row[i+1]; j++) {
+    int e = var_entry(init.var[j], false);
+    if (e < 0 || e >= delta.vars)
+      continue; //no leaf is labeled with it
+    delta.seen[e] = stamp;
+    delta_assign(e, (init.val[j] < INFINITY) ? init.val[j] : INFINITY);
   }
-  //readpoll table: [parentNode][pipes from var leaves if you are a root][var/opartor pipes]
-  size_t n=1;
-  if (self->is_root) {
-    n += self->pipes_counter;
+  int given_len = 0;
+  for (int j=0; j<delta.given_len; j++) {
+    int e = delta.given[j];
+    if (delta.seen[e] != stamp)
+      delta_assign(e, INFINITY);
   }
-  int oftype = 0;
-  entries = calloc(n+2, sizeof(*entries));
-  entries[0].fd = self->read_from_parent;
-  entries[0].events = POLLIN;
-  for (int i=0; i<self->pipes_counter; i++) {
-    entries[i+1].events = POLLIN;
-    entries[i+1].fd = self->root_read_from_var[i];
+  for (size_t j=init.row[i]; j<init.row[i+1]; j++) {
+    int e = var_entry(init.var[j], false);
+    if (e >= 0 && e < delta.vars && delta.seen[e] == stamp) {
+      delta.seen[e] = -stamp; //listed once even if given twice
+      delta.given[given_len++] = e;
+    }
   }
-  if (self->type == BINARY || self->type == UNARY) {
-    entries[n+oftype].events = POLLIN;
-    entries[n+oftype].fd = self->right->parent_read_from_me;
-    oftype += 1;
-    if (self->type == BINARY) {
-      entries[n+oftype].events = POLLIN;
-      entries[n+(oftype++)].fd = self->left->parent_read_from_me;
+  delta.given_len = given_len;
+  while (delta.heap_len > 0) {
+    int k = delta_pop();
+    Num val;
+    bool err = delta_eval(k, &val);
+    bool same = (err == delta.err[k]) && (err || num_equal(val, delta.val[k]));
+    if (same) { //the nodes above keep their values too
+      free(val.big);
+      continue;
     }
+    free(delta.val[k].big);
+    delta.val[k] = val;
+    delta.err[k] = err;
+    for (int j=delta.dep_start[k]; j<delta.dep_start[k+1]; j++)
+      delta_push(delta.deps[j]);
   }
-  else if (self->type == VAR) {
-    entries[n+oftype].events = POLLIN;
-    entries[n+oftype++].fd = self->var_read_from_circuit;
-    ParseTree treevar = circuit.trees[self->label.var];
-    if (treevar != NULL) {
-      entries[n+oftype].events = POLLIN;
-      entries[n+oftype].fd = treevar->var_read_from_root[self->pipe_id];
-      oftype += 1;
+  int root = delta.pos[tree_of(0)->id];
+  if (delta.err[root])
+    printf("%d F\n", init.labels[i]);
+  else
+    print_answer(init.labels[i], delta.val[root]);
+}
+
+/* Answers [count] queries of the batch in order with delta evaluation */
+void run_delta(int count) {
+  if (delta.order == NULL)
+    delta_open();
+  for (int i=0; i<count; i++) {
+    if (init_value(i, 0) < INFINITY)
+      printf("%d P %d\n", init.labels[i], init_value(i, 0));
+    else
+      delta_query(i);
+  }
+}
+
+/* Forks processes of all the top nodes, returns number of descriptors circuit listens to. */
+size_t spawn_roots() {
+  // a node talks to its parent, circuit, a top and to top children, two pipes each
+  if (!options.pipes)
+    open_arena(8 * (size_t) circuit.list_len + 16);
+  if (prepare_non_tree_pipes() < 0) {
+    looming_doom("PREP NON TREE PIPES");
+  }
+  for (int t=0; t<circuit.tops_len; t++) {
+    ParseTree root = circuit.tops[t];
+    int w_to_root[2];
+    int w_to_circuit[2];
+    if (open_channel(w_to_root) == -1 || open_channel(w_to_circuit) == -1)
+      looming_doom("PIPE BETWEEN CIRC AND ROOT");
+    root->io->parent_read_from_me = w_to_circuit[0];
+    root->io->write_to_parent = w_to_circuit[1];
+    root->io->parent_write_to_me = w_to_root[1];
+    root->io->read_from_parent = w_to_root[0];
+    switch (fork()) {
+      case -1:
+        looming_doom("FORK IN CIRC");
+      case 0: //process of top node t
+        trace_child();
+        for (int i=0; i <= t; i++) {
+          ParseTree droot = circuit.tops[i];
+          close_pipe_or_perish_any_hope(droot->io->parent_read_from_me, "ROOT HERE");
+          close_pipe_or_perish_any_hope(droot->io->parent_write_to_me, "ROOT HERE W");
+        }
+        // you're not a circuit so
+        for (int i=0; i<circuit.list_len; i++) {
+          if (circuit.variables[i]->type == VAR && circuit.variables[i]->io->needed) {
+            close_pipe_or_perish_any_hope(circuit.variables[i]->io->circuit_write_to_var, "ROOT: CIRCS PIPE");
+            close_pipe_or_perish_any_hope(circuit.variables[i]->io->circuit_read_from_var, "ROOT: CIRCS PIPE R");
+          }
+        }
+        processes_tree(root); //should not return
+      default://circuit 
+        close_pipe_or_perish_any_hope(root->io->write_to_parent, "CIRC: ROOT PIPE");
+        close_pipe_or_perish_any_hope(root->io->read_from_parent, "CIRC: ROOT PIPE R");
+    }
+  } 
+  size_t how_many_labeled_vars = 0;
+  // only circuit should step in here
+  for (int i=0; i<circuit.list_len; i++) {
+    ParseTree node = circuit.variables[i];
+    if (node->type == VAR && node->io->needed) {
+      ++how_many_labeled_vars;
+      close_pipe_or_perish_any_hope(node->io->var_write_to_circuit, "CIRC: VARW");
+      close_pipe_or_perish_any_hope(node->io->var_read_from_circuit, "CIRC: VAR READ");
+    }
+    if (is_top(node)) {
+      for (int i=0; i<node->io->pipes_counter; i++) {
+        close_pipe_or_perish_any_hope(node->io->clients[i].root_write_to_var, "CIRC: ROOTWVAR");
+        close_pipe_or_perish_any_hope(node->io->clients[i].root_read_from_var, "CIRC: ROOTRVAR");
+        close_pipe_or_perish_any_hope(node->io->clients[i].var_write_to_root, "CIRC: VARWROOT");
+        close_pipe_or_perish_any_hope(node->io->clients[i].var_read_from_root, "CIRC: VARRROOT");
+      }
     }
   }
-  bool finish = false;
-  int ret, len;
-  while (!finish) {
-    for (int i=0; i<n+oftype; i++)
-      entries[i].revents = 0;
-    if ((ret = poll(entries, n+oftype, -1)) < 0) {
-      looming_doom ("POLL READ CHILD");
+  return how_many_labeled_vars + 1; //and the root of x[0]
+}
+
+/* Forks processes of the units with --max-procs, all of them children of the circuit, and
+   returns how many of them circuit listens to */
+size_t spawn_units() {
+  // a process talks to the circuit, to the unit above and to pieces below, two pipes each
+  if (!options.pipes)
+    open_arena(4 * (size_t) options.max_procs + 16);
+  if (prepare_needed() < 0)
+    looming_doom("PREP UNITS");
+  plan_units();
+  for (int p=0; p<units.procs_len; p++) {
+    int w_to_proc[2], w_to_circuit[2];
+    if (open_channel(w_to_proc) < 0 || open_channel(w_to_circuit) < 0)
+      looming_doom("PIPE BETWEEN CIRC AND UNITS");
+    UnitProc *proc = &units.procs[p];
+    proc->read = w_to_proc[0];
+    proc->circuit_write = w_to_proc[1];
+    proc->circuit_read = w_to_circuit[0];
+    proc->write = w_to_circuit[1];
+    proc->parent_read = proc->parent_write = -1;
+  }
+  for (int u=0; u<units.len; u++) {
+    for (int k=0; k<units.list[u].inputs_len; k++) {
+      UnitInput *in = &units.list[u].inputs[k];
+      if (in->var >= 0)
+        continue;
+      int w_to_piece[2], w_to_parent[2];
+      if (open_channel(w_to_piece) < 0 || open_channel(w_to_parent) < 0)
+        looming_doom("PIPE BETWEEN UNITS");
+      UnitProc *piece = &units.procs[units.list[in->at].proc];
+      in->write = w_to_piece[1];
+      in->read = w_to_parent[0];
+      piece->parent_read = w_to_piece[0];
+      piece->parent_write = w_to_parent[1];
     }
-    else if (ret > 0) {
-      for (int i=0; i<n+oftype; i++) {
-        if (entries[i].revents & POLLHUP) {
-          finish = true; //pipe is closed
-        }
-        if (entries[i].revents & (POLLIN | POLLERR)) {
-          if ((len = read(entries[i].fd, &message, sizeof(message))) == -1)
-            looming_doom("READ IN CHILD");
-          if (len == 0) {
-            finish = true;
+  }
+  for (int p=0; p<units.procs_len; p++) {
+    switch (fork()) {
+      case -1:
+        looming_doom("FORK UNITS");
+      case 0: //keeps only its own pipes
+        trace_child();
+        for (int q=0; q<units.procs_len; q++) {
+          UnitProc *proc = &units.procs[q];
+          close_pipe_or_perish_any_hope(proc->circuit_read, "UNITS: CIRCS PIPE R");
+          close_pipe_or_perish_any_hope(proc->circuit_write, "UNITS: CIRCS PIPE");
+          if (q == p)
+            continue;
+          close_pipe_or_perish_any_hope(proc->read, "UNITS: OTHER R");
+          close_pipe_or_perish_any_hope(proc->write, "UNITS: OTHER");
+          if (proc->parent_read >= 0) {
+            close_pipe_or_perish_any_hope(proc->parent_read, "UNITS: OTHER PARENT R");
+            close_pipe_or_perish_any_hope(proc->parent_write, "UNITS: OTHER PARENT");
           }
-          else {
-            switch(self->type) {
-              case PNUM:
-                pnum_response(self, message.i, i);
-                break;
-              case VAR:
-                var_response(self, x, cache_status, cached, &message, i, n);
-                break;
-              case BINARY:
-              case UNARY:
-                op_response(self, x, cache_status, cached, &message, i, n);
-                break;
-              default:
-                looming_doom("NODE TYPE ERR");
+        }
+        for (int u=0; u<units.len; u++) {
+          for (int k=0; units.list[u].proc != p && k<units.list[u].inputs_len; k++) {
+            if (units.list[u].inputs[k].var < 0) {
+              close_pipe_or_perish_any_hope(units.list[u].inputs[k].read, "UNITS: OTHER PIECE R");
+              close_pipe_or_perish_any_hope(units.list[u].inputs[k].write, "UNITS: OTHER PIECE");
             }
           }
         }
+        serve_units(p);
+        looming_doom(NULL);
+      default:
+        break;
+    }
+  }
+  // only circuit should step in here
+  for (int p=0; p<units.procs_len; p++) {
+    UnitProc *proc = &units.procs[p];
+    close_pipe_or_perish_any_hope(proc->read, "CIRC: UNITS R");
+    close_pipe_or_perish_any_hope(proc->write, "CIRC: UNITS");
+    if (proc->parent_read >= 0) {
+      close_pipe_or_perish_any_hope(proc->parent_read, "CIRC: PIECE R");
+      close_pipe_or_perish_any_hope(proc->parent_write, "CIRC: PIECE");
+    }
+  }
+  for (int u=0; u<units.len; u++) {
+    for (int k=0; k<units.list[u].inputs_len; k++) {
+      if (units.list[u].inputs[k].var < 0) {
+        close_pipe_or_perish_any_hope(units.list[u].inputs[k].read, "CIRC: PIECE UNIT R");
+        close_pipe_or_perish_any_hope(units.list[u].inputs[k].write, "CIRC: PIECE UNIT");
       }
     }
   }
-  free(entries);
-  free(cached);
-  free(cache_status);
+  return units.procs_len;
+}
+
+/* What circuit listens to: the root of x[0] and all the var leaves, set up for the first
+   batch and kept until the last one */
+struct Listeners {
+  EventLoop loop;
+  ParseTree *nodes; //position of descriptor -> node it belongs to
+  int *fds;
+} listeners;
+
+#define MEMO_CAP (1 << 20) //answers kept, the memo starts over when a batch finds it full
+#define MEMO_KEYS_CAP (1 << 22) //ints of fingerprints kept, likewise
+
+/* Answers by fingerprint of the query: assignments of its init list to variables of var
+   leaves x[0] depends on, the others cannot change the answer. Queries of the same
+   fingerprint go to the tree once, the answer is printed for every one of them. */
+typedef struct {
+  uint64_t hash;
+  size_t key; //the assignments, pairs of variable and value at memo.keys[key]
+  int key_len;
+  int query; //batch position of the one sent to the tree, the others of the batch wait on its list
+  signed char status; //0 in flight, 1 F, 2 computed
+  Num val;
+} MemoEntry;
+
+struct Memo {
+  bool *relevant; //per entry of var_table
+  size_t vars; //entries of var_table when relevant was made
+  MemoEntry *entries;
+  size_t len;
+  size_t cap;
+  int *table; //open addressing over entries, -1 marks an empty slot
+  size_t table_cap; //power of two
+  int *keys;
+  size_t keys_len;
+  size_t keys_cap;
+  int *entry_of; //batch position -> its entry
+  int *next_waiter; //batch position -> the next one waiting for the same answer, -1 ends
+} memo;
+
+/* Empties the memo keeping the variables it looks at */
+void memo_reset() {
+  for (size_t j=0; j<memo.len; j++)
+    free(memo.entries[j].val.big);
+  memo.len = memo.keys_len = 0;
+  for (size_t h=0; h<memo.table_cap; h++)
+    memo.table[h] = -1;
+}
+
+void memo_free() {
+  memo_reset();
+  free(memo.relevant);
+  free(memo.entries);
+  free(memo.table);
+  free(memo.keys);
+  free(memo.entry_of);
+  free(memo.next_waiter);
+  memo = (struct Memo) {0};
 }
 
-/* x:{X[0], .., X[V-1]} */
-void processes_tree(int x) {
-  //Tree x defienietly doesn't need other trees' descriptors to write to var labeled leaves 
-  ParseTree self = circuit.trees[x];
-  for (int i=0; i<NODES_MAX; i++) {
-    ParseTree root = circuit.trees[i];
-    if (i == x || root == NULL) {
+/* Appends the fingerprint of query [i] of the batch to memo.keys, returns its hash */
+uint64_t memo_key(int i, int *key_len) {
+  uint64_t hash = 14695981039346656037ull;
+  *key_len = 0;
+  for (size_t j=init.row[i]; j<init.row[i+1]; j++) {
+    int var = init.var[j];
+    int e = (init.val[j] < INFINITY) ? var_entry(var, false) : -1;
+    if (e < 0 || e >= memo.vars || !memo.relevant[e])
       continue;
+    if (memo.keys_len + 2 > memo.keys_cap) {
+      size_t nsize = (memo.keys_cap == 0) ? 1024 : 2*memo.keys_cap;
+      int *nkeys = realloc(memo.keys, sizeof(*memo.keys) * nsize);
+      if (nkeys == NULL)
+        looming_doom("MEMO KEYS");
+      memo.keys = nkeys;
+      memo.keys_cap = nsize;
     }
-    if (root->root_write_to_var != NULL) {
-      for(int j=0; j<root->pipes_counter; j++) {
-        if (close(root->root_write_to_var[j]) < 0 || close(root->root_read_from_var[j]) < 0)
-          looming_doom("CLOSE WRITE PIPES FOR OTHER ROOTS");
-      }
+    memo.keys[memo.keys_len++] = var;
+    memo.keys[memo.keys_len++] = init.val[j];
+    hash = (hash ^ (unsigned) var) * 1099511628211ull;
+    hash = (hash ^ (unsigned) init.val[j]) * 1099511628211ull;
+    ++*key_len;
+  }
+  return hash;
+}
+
+/* Finds entry of the fingerprint of query [i] of the batch or adds one for it, sets [fresh]
+   if it was added. Returns position of the entry. */
+int memo_entry(int i, bool *fresh) {
+  int key_len;
+  size_t key = memo.keys_len;
+  uint64_t hash = memo_key(i, &key_len);
+  if (2*(memo.len + 1) > memo.table_cap) {
+    size_t nsize = (memo.table_cap == 0) ? 1024 : 2*memo.table_cap;
+    int *ntable = realloc(memo.table, sizeof(*memo.table) * nsize);
+    if (ntable == NULL)
+      looming_doom("MEMO TABLE");
+    memo.table = ntable;
+    memo.table_cap = nsize;
+    for (size_t h=0; h<nsize; h++)
+      memo.table[h] = -1;
+    for (size_t j=0; j<memo.len; j++) {
+      size_t h = memo.entries[j].hash & (nsize - 1);
+      while (memo.table[h] != -1)
+        h = (h+1) & (nsize - 1);
+      memo.table[h] = j;
     }
   }
-  //So now create the processes tree mapping ParseTree of x
-  int w_to_c[2], w_to_p[2];
-  bool parent_proc = false;
-  while (!parent_proc && (self->type == BINARY || self->type == UNARY)) {
-    bool child = false;
-    for (int i=0; i<1+(self->type == BINARY) && !child; i++) {
-      if (pipe(w_to_c) < 0 || pipe(w_to_p)) {
-        looming_doom("PIPES BETWEEN TREE NODES");
-      }
-      switch (fork()) {
-        case -1:
-          looming_doom("FORK IN PROC_NODE");
-        case 0:
-          if (self->is_root && self->root_write_to_var != NULL) { //you're children, dispose root desc
-            for (int j=0; j<self->pipes_counter; j++) {
-              if (close(self->root_write_to_var[j]) < 0 || close(self->root_read_from_var[j]) < 0)
-                looming_doom("CLOSE WRITE TO VARS IN NONROOT");
-            }
-          }
-          // close pipes to grandparent
-          close_pipe_or_perish_any_hope(self->read_from_parent, "GRANDP");
-          close_pipe_or_perish_any_hope(self->write_to_parent, "GRANDP");
-          if (i == 0) {
-            self = self->right;
-          }
-          else { //you're the second child
-            close_pipe_or_perish_any_hope(self->right->parent_read_from_me, "LEFT CHILD");
-            close_pipe_or_perish_any_hope(self->right->parent_write_to_me, "LEFT CHILD W");
-            self = self->left;
-          }
-          self->read_from_parent = w_to_c[0];
-          self->write_to_parent = w_to_p[1];
-          self->parent_read_from_me = w_to_p[0];
-          self->parent_write_to_me = w_to_c[1];
-          close_pipe_or_perish_any_hope(self->parent_read_from_me, "CHILD PARENT");
-          close_pipe_or_perish_any_hope(self->parent_write_to_me, "CHILD PARENT W");
-          parent_proc = false;
-          child = true;
-          break;
-        default: ;
-          ParseTree child = (i==0) ? self->right : self->left;
-          child->read_from_parent = w_to_c[0];
-          child->write_to_parent = w_to_p[1];
-          child->parent_read_from_me = w_to_p[0];
-          child->parent_write_to_me = w_to_c[1];
-          close_pipe_or_perish_any_hope(child->read_from_parent, "FROM PARENT WITH ERROR");
-          close_pipe_or_perish_any_hope(child->write_to_parent, "FROM PARENT WITH ERROR W");
-          parent_proc = true;
-      }
+  size_t h = hash & (memo.table_cap - 1);
+  for (; memo.table[h] != -1; h = (h+1) & (memo.table_cap - 1)) {
+    MemoEntry *e = &memo.entries[memo.table[h]];
+    if (e->hash == hash && e->key_len == key_len
+        && memcmp(memo.keys + e->key, memo.keys + key, sizeof(int) * 2 * key_len) == 0) {
+      memo.keys_len = key; //the same key is already there
+      *fresh = false;
+      return memo.table[h];
     }
   }
-  //we have the whole tree, so all 'to be propagated' pipes reached thier destination;
-  //close copies that missed the point
-  for (int i=0; i<circuit.list_len; i++) {
-    ParseTree node = circuit.variables[i];
-    if (node->type == VAR && !(self->type == VAR && self->id == node->id)) {
-      close_pipe_or_perish_any_hope(node->var_write_to_circuit, "UNNEC VAR CIRC");
-      close_pipe_or_perish_any_hope(node->var_read_from_circuit, "UNNEC VAR CIRC R");
-    } 
+  if (memo.len == memo.cap) {
+    size_t nsize = (memo.cap == 0) ? 1024 : 2*memo.cap;
+    MemoEntry *nentries = realloc(memo.entries, sizeof(*memo.entries) * nsize);
+    if (nentries == NULL)
+      looming_doom("MEMO ENTRIES");
+    memo.entries = nentries;
+    memo.cap = nsize;
   }
-  for (int v=0; v<NODES_MAX; v++) {
-    ParseTree node = circuit.trees[v];
-    if (node == NULL)
-      continue;
-    for (int i=0; i<node->pipes_counter; i++) {
-      if (self->type == VAR && self->label.var == v && self->pipe_id == i)
-        continue;
-      close_pipe_or_perish_any_hope(node->var_write_to_root[i], "UNNEC TO ROOT");
-      close_pipe_or_perish_any_hope(node->var_read_from_root[i], "UNNEC TO ROOT R");
+  memo.entries[memo.len] = (MemoEntry) {.hash = hash, .key = key, .key_len = key_len, .query = i};
+  memo.table[h] = memo.len;
+  *fresh = true;
+  return memo.len++;
+}
+
+/* Prepares the memo for a batch of [count] queries, the first call finds out which variables
+   matter from var leaves that got processes. While streaming every batch starts with an
+   empty memo, so that memory stays bounded by the window. */
+void memo_open(int count) {
+  if (memo.relevant == NULL) {
+    for (int i=0; i<circuit.list_len; i++) {
+      ParseTree node = circuit.variables[i];
+      if (node->type == VAR && node->io->needed && var_entry(node->label.var, true) < 0)
+        looming_doom("MEMO");
+    }
+    memo.vars = circuit.table_len;
+    if ((memo.relevant = calloc(memo.vars + 1, sizeof(bool))) == NULL)
+      looming_doom("MEMO");
+    for (int i=0; i<circuit.list_len; i++) {
+      ParseTree node = circuit.variables[i];
+      if (node->type == VAR && node->io->needed)
+        memo.relevant[var_entry(node->label.var, false)] = true;
     }
   }
-  listen(self, x);
-  if (self->type == BINARY || self->type == UNARY) {
-    close(self->right->parent_write_to_me);
-    if (self->type == BINARY)
-      close(self->left->parent_write_to_me);
+  if (memo.entry_of == NULL) { //the first batch is the largest one
+    memo.entry_of = calloc(count + 1, sizeof(int));
+    memo.next_waiter = calloc(count + 1, sizeof(int));
+    if (memo.entry_of == NULL || memo.next_waiter == NULL)
+      looming_doom("MEMO");
   }
-  for (int i=0; i < 2*(self->type == BINARY) + (self->type == UNARY); i++) {
-    if (wait(0) == -1)
-      looming_doom("WAIT ERR");
+  if (options.stream || memo.len >= MEMO_CAP || memo.keys_len >= MEMO_KEYS_CAP)
+    memo_reset();
+}
+
+/* Var leaves of units waiting for equations circuit asked on their behalf, listed for
+   every pair of equation and query of the batch, only with --max-procs */
+typedef struct {
+  int proc; //of the leaf
+  int at; //what the answer for the leaf carries
+  int next; //-1 ends the list
+} UnitWaiter;
+
+typedef struct {
+  int unit; //equation asked, -1 marks an empty slot
+  int q; //batch position of the query
+  int head; //leaves waiting for the answer, -1 if it is not in flight
+} WaitSlot;
+
+struct Waiters {
+  WaitSlot *table; //open addressing with linear probing, emptied for every batch
+  size_t len;
+  size_t cap; //power of two
+  UnitWaiter *list;
+  size_t list_len;
+  size_t list_cap;
+} waiters;
+
+/* Empties the waiters for the next batch */
+void waiters_reset() {
+  waiters.len = waiters.list_len = 0;
+  for (size_t h=0; h<waiters.cap; h++)
+    waiters.table[h].unit = -1;
+}
+
+/* Slot of equation [unit] asked for query [q] of the batch, added if it is not there */
+WaitSlot *wait_slot(int unit, int q) {
+  if (2*(waiters.len + 1) > waiters.cap) {
+    WaitSlot *old = waiters.table;
+    size_t ocap = waiters.cap;
+    waiters.cap = (ocap == 0) ? 1024 : 2*ocap;
+    if ((waiters.table = malloc(sizeof(*waiters.table) * waiters.cap)) == NULL)
+      looming_doom("WAITERS");
+    waiters.len = 0;
+    for (size_t h=0; h<waiters.cap; h++)
+      waiters.table[h].unit = -1;
+    for (size_t h=0; h<ocap; h++) {
+      if (old[h].unit != -1)
+        *wait_slot(old[h].unit, old[h].q) = old[h];
+    }
+    free(old);
   }
-  looming_doom(NULL);
+  size_t h = ((unsigned) unit * 2654435761u ^ (unsigned) q * 40503u) & (waiters.cap - 1);
+  for (; waiters.table[h].unit != -1; h = (h+1) & (waiters.cap - 1)) {
+    if (waiters.table[h].unit == unit && waiters.table[h].q == q)
+      return &waiters.table[h];
+  }
+  waiters.len++;
+  waiters.table[h] = (WaitSlot) {unit, q, -1};
+  return &waiters.table[h];
 }
 
+/* Serves process [p] of units. Its var leaf asks for the value of its variable, which is
+   looked up in the init list or, if there is none, in the equation of the variable asked
+   for all the leaves waiting for it at once. Equation's answer goes to each of them. */
+void serve_unit_proc(int p, Mes *mes) {
+  int q = mes->i - init.base;
+  if (mes->at % 2 == 0) { //answer of an equation
+    if (q < 0) //batch is over
+      return;
+    WaitSlot *slot = wait_slot(mes->at / 2, q);
+    for (int w=slot->head; w != -1; w = waiters.list[w].next)
+      send_at(units.procs[waiters.list[w].proc].circuit_write, mes->i, waiters.list[w].at, mes->val, mes->err);
+    slot->head = -1;
+    return;
+  }
+  long val = (q >= 0) ? init_value(q, mes->val.val) : INFINITY; //earlier batch is over
+  ParseTree treevar = tree_of(mes->val.val);
+  if (val < INFINITY || q < 0 || treevar == NULL) {
+    send_at(units.procs[p].circuit_write, mes->i, mes->at, (Num) {(val < INFINITY) ? val : 0, NULL}, val >= INFINITY);
+    return;
+  }
+  int u = treevar->io->unit;
+  if (waiters.list_len == waiters.list_cap) {
+    size_t nsize = (waiters.list_cap == 0) ? 1024 : 2*waiters.list_cap;
+    UnitWaiter *nlist = realloc(waiters.list, sizeof(*waiters.list) * nsize);
+    if (nlist == NULL)
+      looming_doom("WAITERS");
+    waiters.list = nlist;
+    waiters.list_cap = nsize;
+  }
+  WaitSlot *slot = wait_slot(u, q);
+  if (slot->head == -1) //equation answers every leaf that asks while the query is in flight
+    send_at(units.procs[units.list[u].proc].circuit_write, mes->i, 2*u, (Num) {0, NULL}, false);
+  waiters.list[waiters.list_len] = (UnitWaiter) {p, mes->at, slot->head};
+  slot->head = waiters.list_len++;
+}
 
-int main() {
-  scanf("%d%d%d", &N, &K, &V);
-  if (init_circuit() == 0) {
-    char *line = NULL;
-    size_t len = 0;
-    for (int k=1; k<=K; k++) {
-      scanf("%d", &nr);
-      if (getline(&line, &len, stdin) < 0)
-        break;
-      char *mock_line = line;
-      Label label;
-      NodeType nodetype = retrieve_var(&mock_line, &label); //left side of equation
-      if (nodetype != VAR || circuit.trees[label.var] != NULL) {
-        printf("%d F\n", nr);
-        free(line);
-        looming_doom(NULL);
+/* Sends [count] queries of the batch to the root of x[0] and serves var leaves asking for
+   init list values until all of them are answered. Circuit listens to [listened] descriptors,
+   the root of x[0] and the var leaves or, with --max-procs, processes of the units. */
+void dispatch_queries(size_t listened, int count) {
+  Mes message;
+  ssize_t len;
+  ParseTree *node2write = listeners.nodes;
+  int *fds = listeners.fds;
+  if (node2write == NULL) {
+    node2write = listeners.nodes = calloc(listened + 1, sizeof(ParseTree));
+    fds = listeners.fds = calloc(listened + 1, sizeof(int));
+    if (node2write == NULL || fds == NULL)
+      looming_doom("CIRC LISTENERS");
+    if (options.max_procs > 0) {
+      for (int p=0; p<listened; p++)
+        fds[p] = units.procs[p].circuit_read;
+    }
+    else {
+      node2write[0] = tree_of(0);
+      fds[0] = tree_of(0)->io->parent_read_from_me;
+      size_t entq = 1;
+      for (int i=0; i<circuit.list_len; i++) {
+        ParseTree node = circuit.variables[i];
+        if (node->type == VAR && node->io->needed) {
+          fds[entq] = node->io->circuit_read_from_var;
+          node2write[entq++] = node;
+        }
       }
-      while (*mock_line != '\0' && (isspace(*mock_line) || *mock_line == '='))
-        ++mock_line;
-      ParseTree tree = parse_line(&mock_line, NULL, NULL);
-      if (tree == NULL) {
-        free(line);
-        looming_doom("PARSE ERR");
+    }
+    loop_open(&listeners.loop, listened);
+    for (int i=0; i<listened; i++)
+      loop_add(&listeners.loop, fds[i], i);
+  }
+  //with --max-procs x[0] is asked through the process of its unit, the answer comes from there
+  int x0_unit = (options.max_procs > 0) ? tree_of(0)->io->unit : -1;
+  int x0_at = (x0_unit >= 0) ? 2*x0_unit : -1;
+  int x0_write = (x0_unit >= 0) ? units.procs[units.list[x0_unit].proc].circuit_write : tree_of(0)->io->parent_write_to_me;
+  memo_open(count);
+  waiters_reset();
+  int answers = 0;
+  int next = 0, in_flight = 0;
+  int ret;
+  bool finish = false;
+  while (true) {
+    //queries go out as answers come back, so that the tree is never flooded with them
+    for (; next < count && in_flight < options.in_flight; next++) {
+      int i = next;
+      bool fresh;
+      if (init_value(i, 0) < INFINITY) { //not an infinity
+        printf("%d P %d\n", init.labels[i], init_value(i, 0));
+        ++answers;
+        continue;
       }
-      circuit.trees[label.var] = tree;
-      tree->is_root = true;
-      if (topo_sort() < 0) {
-        printf("%d F\n", nr);
-        free(line);
-        looming_doom(NULL);
+      int j = memo_entry(i, &fresh);
+      MemoEntry *e = &memo.entries[j];
+      if (fresh) {
+        memo.entry_of[i] = j;
+        memo.next_waiter[i] = -1;
+        TRACE('b', "query", init.base + i);
+        enqueue_at(x0_write, init.base + i, x0_at, (Num) {-1, NULL}, false);
+        in_flight++;
       }
-      else {
-        printf("%d P\n", nr);
+      else if (e->status == 0) { //in flight, wait for it
+        memo.next_waiter[i] = memo.next_waiter[e->query];
+        memo.next_waiter[e->query] = i;
+        counters.cache_hits++;
+      }
+      else { //answered in an earlier batch
+        if (e->status == 1)
+          printf("%d F\n", init.labels[i]);
+        else
+          print_answer(init.labels[i], e->val);
+        ++answers;
+        counters.cache_hits++;
       }
     }
-    fflush(stdout);
-    free(line);
-    if (prepare_non_tree_pipes() < 0) {
-      looming_doom("PREP NON TREE PIPES");
-    }
-    for (int v=circuit.topo_ord_len - 1; v>=0; v--) {
-      ParseTree root = circuit.trees[circuit.topo_ord[v]];
-      int w_to_root[2];
-      int w_to_circuit[2];
-      if (pipe(w_to_root) == -1 || pipe(w_to_circuit) == -1)
-        looming_doom("PIPE BETWEEN CIRC AND ROOT");
-      root->parent_read_from_me = w_to_circuit[0];
-      root->write_to_parent = w_to_circuit[1];
-      root->parent_write_to_me = w_to_root[1];
-      root->read_from_parent = w_to_root[0];
-      switch (fork()) {
-        case -1:
-          looming_doom("FORK IN CIRC");
-        case 0: //root process of variable v
-          for (int i=v; i < circuit.topo_ord_len; i++) {
-            ParseTree droot = circuit.trees[circuit.topo_ord[i]];
-            close_pipe_or_perish_any_hope(droot->parent_read_from_me, "ROOT HERE");
-            close_pipe_or_perish_any_hope(droot->parent_write_to_me, "ROOT HERE W");
+    flush_messages();
+    if (answers >= count || finish)
+      break;
+    if ((ret = loop_wait(&listeners.loop)) < 0) {
+      looming_doom ("POLL READ CIRC");
+    }
+    for (int k=0; k<ret; k++) {
+      int i = listeners.loop.events[k].data.u32;
+      if (listeners.loop.events[k].events & EPOLLHUP) {
+        finish = true; //pipe is closed
+      }
+      if ((len = receive_messages(fds[i])) == -1)
+        looming_doom("READ IN CIRC");
+      if (len == 0) {
+        finish = true;
+      }
+      while (next_message(fds[i], &message)) {
+        int q = message.i - init.base;
+        if ((x0_unit >= 0) ? message.at == x0_at : i == 0) {
+          TRACE('e', "query", message.i);
+          in_flight--;
+          MemoEntry *e = &memo.entries[memo.entry_of[q]];
+          e->status = message.err ? 1 : 2;
+          e->val = take_value(&message);
+          for (int w=q; w != -1; w = memo.next_waiter[w]) {
+            if (message.err)
+              printf("%d F\n", init.labels[w]);
+            else
+              print_answer(init.labels[w], e->val);
+            answers++;
           }
-          // you're not a circuit so
-          for (int i=0; i<circuit.list_len; i++) {
-            if (circuit.variables[i]->type == VAR) {
-              close_pipe_or_perish_any_hope(circuit.variables[i]->circuit_write_to_var, "ROOT: CIRCS PIPE");
-              close_pipe_or_perish_any_hope(circuit.variables[i]->circuit_read_from_var, "ROOT: CIRCS PIPE R");
-            }
+        }
+        else if (x0_unit >= 0) {
+          serve_unit_proc(i, &message);
+        }
+        else if (q < 0) { //query of an earlier batch that was already answered
+          send_message(node2write[i]->io->circuit_write_to_var, message.i, 0, true);
+        }
+        else {
+          long var = init_value(q, node2write[i]->label.var);
+          if (var < INFINITY) { //not an infinity
+            send_message(node2write[i]->io->circuit_write_to_var, message.i, var, false);
+          }
+          else {
+            send_message(node2write[i]->io->circuit_write_to_var, message.i, 0, true);
           }
-          processes_tree(circuit.topo_ord[v]); //should not return
-        default://circuit 
-          close_pipe_or_perish_any_hope(root->write_to_parent, "CIRC: ROOT PIPE");
-          close_pipe_or_perish_any_hope(root->read_from_parent, "CIRC: ROOT PIPE R");
-      }
-    } 
-    size_t how_many_labeled_vars = 0;
-    // only circuit should step in here
-    for (int i=0; i<circuit.list_len; i++) {
-      ParseTree node = circuit.variables[i];
-      if (node->type == VAR) {
-        ++how_many_labeled_vars;
-        close_pipe_or_perish_any_hope(node->var_write_to_circuit, "CIRC: VARW");
-        close_pipe_or_perish_any_hope(node->var_read_from_circuit, "CIRC: VAR READ");
-      }
-      if (node->is_root) {
-        for (int i=0; i<node->pipes_counter; i++) {
-          close_pipe_or_perish_any_hope(node->root_write_to_var[i], "CIRC: ROOTWVAR");
-          close_pipe_or_perish_any_hope(node->root_read_from_var[i], "CIRC: ROOTRVAR");
-          close_pipe_or_perish_any_hope(node->var_write_to_root[i], "CIRC: VARWROOT");
-          close_pipe_or_perish_any_hope(node->var_read_from_root[i], "CIRC: VARRROOT");
         }
       }
     }
-    line = NULL;
-    len = 0;
-    char *err = NULL;
-    int *vars = calloc(NODES_MAX*(N-K), sizeof(int));
-    int *labels = calloc(N-K, sizeof(int));
-    if (vars == NULL || labels == NULL)
-      looming_doom("VARS");
-    for (int j=0; j<NODES_MAX*(N-K); j++)
-      vars[j] = INFINITY; //INFINITY
-    for (int i=0; i<N-K && err == NULL; i++) {
-      scanf("%d", &nr);
-      labels[i] = nr;
-      if (getline(&line, &len, stdin) < 0) {
-        err = "GETLINE 2";
-        break;
+  }
+  if (init.lines == N-K || finish) {
+    memo_free();
+    loop_close(&listeners.loop);
+    free(listeners.nodes);
+    free(listeners.fds);
+    free(waiters.table);
+    free(waiters.list);
+    listeners.nodes = NULL;
+  }
+}
+
+/* Snapshot file: header, labels of equation lines, nodes, trees in topological order, the
+   compiled program and ends of its trees, each section aligned to 8 bytes. Records are
+   written as they are in memory, so a snapshot is only read by the build that wrote it.
+   Nodes come after their children, and the header keeps a hash of the equation lines. */
+#define SNAPSHOT_MAGIC "PW3SNAP"
+#define SNAPSHOT_LAYOUT (2u << 24 | sizeof(SnapNode) << 16 | sizeof(Instr) << 8 | sizeof(size_t))
+
+typedef struct {
+  char magic[8];
+  uint32_t layout;
+  int32_t K;
+  int32_t verdicts; //labels of the equation lines, the last one is F if [failed]
+  int32_t failed; //validation stopped at a failed equation, nothing else is kept
+  int32_t nodes;
+  int32_t trees;
+  int32_t x0_tree;
+  int32_t slots;
+  uint64_t code_len;
+  uint64_t depth;
+  uint64_t equations; //hash of the equation lines it was made from
+} SnapshotHeader;
+
+typedef struct {
+  Label label;
+  int32_t type;
+  int32_t left, right; //ids of children, -1 if there is none
+  int32_t parents;
+  int32_t post; //-1 unless node is a root
+} SnapNode;
+
+typedef struct {
+  int32_t var;
+  int32_t root; //id of the root node
+} SnapTree;
+
+/* Offsets of the sections */
+typedef struct {
+  size_t verdicts, nodes, trees, code, tree_end, size;
+} SnapshotLayout;
+
+size_t align8(size_t off) {
+  return (off + 7) & ~(size_t)7;
+}
+
+SnapshotLayout snapshot_layout(const SnapshotHeader *h) {
+  SnapshotLayout l;
+  l.verdicts = align8(sizeof(*h));
+  l.nodes = align8(l.verdicts + sizeof(int32_t) * h->verdicts);
+  l.trees = align8(l.nodes + sizeof(SnapNode) * h->nodes);
+  l.code = align8(l.trees + sizeof(SnapTree) * h->trees);
+  l.tree_end = align8(l.code + sizeof(Instr) * h->code_len);
+  l.size = l.tree_end + sizeof(size_t) * h->trees;
+  return l;
+}
+
+/* Adds equation line [nr] to [hash], [line] is the rest of it after the number */
+uint64_t hash_line(uint64_t hash, int nr, const char *line) {
+  hash = (hash ^ (unsigned) nr) * 1099511628211ull;
+  for (; *line != '\n'; line++)
+    hash = (hash ^ (unsigned char) *line) * 1099511628211ull;
+  return hash;
+}
+
+/* Writes the circuit validated so far to options.save_snapshot, [failed] is the label of
+   the equation line that failed or -1 if all of them passed */
+void save_snapshot(int failed) {
+  if (failed < 0 && program.tree_end == NULL && circuit.topo_ord_len > 0 && compile_program() < 0)
+    looming_doom("COMPILE PROGRAM");
+  SnapshotHeader h = {SNAPSHOT_MAGIC, SNAPSHOT_LAYOUT, K, verdicts.len, failed >= 0};
+  h.verdicts += h.failed;
+  h.equations = equations_hash;
+  h.x0_tree = x0_tree;
+  if (failed < 0) {
+    h.nodes = circuit.list_len;
+    h.trees = circuit.topo_ord_len;
+    h.slots = program.slots;
+    h.code_len = program.len;
+    h.depth = program.depth;
+  }
+  SnapshotLayout l = snapshot_layout(&h);
+  int fd = open(options.save_snapshot, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, l.size) < 0)
+    looming_doom("SNAPSHOT WRITE");
+  char *map = mmap(NULL, l.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    looming_doom("SNAPSHOT WRITE");
+  memcpy(map, &h, sizeof(h));
+  memcpy(map + l.verdicts, verdicts.list, sizeof(int32_t) * verdicts.len);
+  if (h.failed)
+    ((int32_t *)(map + l.verdicts))[verdicts.len] = failed;
+  //nodes are renumbered children first, so that a loader can tell a cycle by a child id
+  SnapNode *nodes = (SnapNode *)(map + l.nodes);
+  int *ids = malloc(sizeof(*ids) * (h.nodes + 1)); //node id -> its id in the snapshot
+  if (ids == NULL)
+    looming_doom("SNAPSHOT WRITE");
+  for (int i=0; i<h.nodes; i++)
+    ids[i] = -1;
+  int next = 0;
+  WalkStack st = {0};
+  for (int i=0; i<h.nodes; i++) {
+    if (ids[i] >= 0)
+      continue;
+    if (walk_push(&st, circuit.variables[i], NULL) < 0)
+      looming_doom("SNAPSHOT WRITE");
+    while (st.len > 0) {
+      WalkFrame *f = &st.frames[st.len - 1];
+      ParseTree t = f->node;
+      if (f->state < 2) {
+        ParseTree child = (f->state++ == 0) ? t->left : t->right;
+        if (child != NULL && ids[child->id] < 0 && walk_push(&st, child, NULL) < 0)
+          looming_doom("SNAPSHOT WRITE");
+        continue;
       }
-      char *mock_line = line;
-      while (*mock_line != '\0' && err == NULL) {
-        Label labell;
-        NodeType nodetypel = retrieve_var(&mock_line, &labell); 
-        if (nodetypel != VAR) {
+      st.len--;
+      ids[t->id] = next;
+      nodes[next++] = (SnapNode) {t->label, t->type, (t->left != NULL) ? ids[t->left->id] : -1,
+          (t->right != NULL) ? ids[t->right->id] : -1, t->parents, t->is_root ? t->post : -1};
+    }
+  }
+  free(st.frames);
+  if (next < h.nodes)
+    looming_doom("SNAPSHOT WRITE");
+  SnapTree *trees = (SnapTree *)(map + l.trees);
+  for (int k=0; k<h.trees; k++)
+    trees[k] = (SnapTree) {circuit.topo_ord[k], ids[tree_of(circuit.topo_ord[k])->id]};
+  free(ids);
+  if (h.code_len > 0)
+    memcpy(map + l.code, program.code, sizeof(Instr) * h.code_len);
+  if (h.trees > 0)
+    memcpy(map + l.tree_end, program.tree_end, sizeof(size_t) * h.trees);
+  if (msync(map, l.size, MS_SYNC) < 0)
+    looming_doom("SNAPSHOT WRITE");
+  munmap(map, l.size);
+}
+
+/* Checks that every instruction of the mapped program stays within the stack, the slots
+   and the trees computed before its own, returns -1 if one does not */
+int check_program(const SnapshotHeader *h) {
+  size_t pc = 0;
+  for (int k=0; k<h->trees; k++) {
+    if (program.tree_end[k] < pc || program.tree_end[k] > h->code_len)
+      return -1;
+    size_t top = 0;
+    for (; pc<program.tree_end[k]; pc++) {
+      Instr *instr = &program.code[pc];
+      switch (instr->code) {
+        case OP_NUM:
+        case OP_VAR:
+        case OP_LOAD:
+          top++;
           break;
-        }
-        Label labelr;
-        NodeType nodetyper = retrieve_var(&mock_line, &labelr); 
-        if (labell.var<0 || labell.var>=NODES_MAX || vars[i*NODES_MAX + labell.var] < INFINITY) {
-          err = "PARSING INIT LIST VAR";
+        case OP_NEG:
+        case OP_SAVE:
+          if (top < 1)
+            return -1;
           break;
-        }
-        vars[i*NODES_MAX + labell.var] = labelr.var;
-        while (*mock_line != '\0' && isspace(*mock_line)) {
-          ++(mock_line); 
-        }
+        case OP_ADD:
+        case OP_MUL:
+          if (top < 2)
+            return -1;
+          top--;
+          break;
+        default:
+          return -1;
       }
-      if (err != NULL)
-        looming_doom(err);
+      if (top > h->depth || (instr->code == OP_VAR && (instr->tree < -1 || instr->tree >= k)))
+        return -1;
+      if ((instr->code == OP_SAVE || instr->code == OP_LOAD) && (instr->var < 0 || instr->var >= h->slots))
+        return -1;
     }
-    free(line);
-    if (circuit.trees[0] == NULL) {
-      for (int i=0; i<N-K; i++) {
-        printf("%d F\n", labels[i]);
+    if (top != 1) //value of the tree
+      return -1;
+  }
+  return 0;
+}
+
+/* Whether child id [id] of node [i] is -1 as it should be when not [present], or an id
+   of a node made before node [i] */
+bool snapshot_child(int32_t id, bool present, int i) {
+  return present ? (id >= 0 && id < i) : (id == -1);
+}
+
+/* Maps options.snapshot instead of reading the equations, which may still be there on
+   the input and are skipped. In-process engine runs the mapped program, processes tree
+   gets its nodes back, in both cases nothing is parsed nor sorted again. Equation lines
+   found on the input have to be the ones the snapshot was made from, and every index
+   read from it is checked before use. */
+void load_snapshot() {
+  int fd = open(options.snapshot, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < sizeof(SnapshotHeader))
+    looming_doom("SNAPSHOT");
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    looming_doom("SNAPSHOT");
+  snapshot.map = map;
+  snapshot.size = st.st_size;
+  SnapshotHeader *h = (SnapshotHeader *) map;
+  if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) != 0 || h->layout != SNAPSHOT_LAYOUT
+      || h->verdicts < h->failed || h->failed < 0 || h->failed > 1 || h->nodes < 0 || h->trees < 0
+      || h->x0_tree < -1 || h->x0_tree >= h->trees || h->slots < 0 || h->slots > h->code_len
+      || h->code_len > st.st_size / sizeof(Instr) || h->depth > h->code_len)
+    looming_doom("SNAPSHOT FORMAT");
+  SnapshotLayout l = snapshot_layout(h);
+  if (l.size > st.st_size)
+    looming_doom("SNAPSHOT FORMAT");
+  if (h->K != K)
+    looming_doom("SNAPSHOT MISMATCH");
+  input_line(); //rest of the header
+  uint64_t hash = 14695981039346656037ull;
+  int skipped = 0;
+  char *line;
+  for (; skipped<K && (line = input_skip_line('=')) != NULL; skipped++) {
+    int label;
+    while (is_blank(*line))
+      line++;
+    if (skipped < h->verdicts && scan_int(&line, &label))
+      hash = hash_line(hash, label, line);
+  }
+  if (skipped > 0 && (skipped < h->verdicts || hash != h->equations))
+    looming_doom("SNAPSHOT MISMATCH");
+  int32_t *labels = (int32_t *)(map + l.verdicts);
+  for (int j=0; j<h->verdicts; j++)
+    printf("%d %c\n", labels[j], (h->failed && j == h->verdicts - 1) ? 'F' : 'P');
+  if (h->failed)
+    looming_doom(NULL);
+  program.code = (Instr *)(map + l.code);
+  program.len = program.cap = h->code_len;
+  program.tree_end = (size_t *)(map + l.tree_end);
+  program.depth = h->depth;
+  program.slots = h->slots;
+  if (check_program(h) < 0 || (h->trees > 0 && program.tree_end[h->trees - 1] != h->code_len))
+    looming_doom("SNAPSHOT FORMAT");
+  circuit.topo_ord_len = h->trees;
+  x0_tree = h->x0_tree;
+  if (options.in_process && !options.delta) //--delta walks the nodes, program is enough otherwise
+    return;
+  SnapNode *nodes = (SnapNode *)(map + l.nodes);
+  for (int i=0; i<h->nodes; i++) {
+    SnapNode *n = &nodes[i];
+    if (n->type < PNUM || n->type > BINARY || (n->type == VAR && n->label.var < 0)
+        || n->post < -1 || n->post >= h->trees || !snapshot_child(n->left, n->type == BINARY, i)
+        || !snapshot_child(n->right, n->type == BINARY || n->type == UNARY, i))
+      looming_doom("SNAPSHOT FORMAT");
+    if (new_tree(n->type, n->label) == NULL)
+      looming_doom("SNAPSHOT NODES");
+  }
+  for (int i=0; i<h->nodes; i++) {
+    ParseTree t = circuit.variables[i];
+    t->left = (nodes[i].left >= 0) ? circuit.variables[nodes[i].left] : NULL;
+    t->right = (nodes[i].right >= 0) ? circuit.variables[nodes[i].right] : NULL;
+    t->parents = nodes[i].parents;
+    t->is_root = (nodes[i].post >= 0);
+    t->post = nodes[i].post;
+  }
+  circuit.topo_ord = (int *) calloc(h->trees + 1, sizeof(*circuit.topo_ord));
+  if (circuit.topo_ord == NULL)
+    looming_doom("SNAPSHOT TREES");
+  circuit.topo_ord_cap = h->trees + 1;
+  SnapTree *trees = (SnapTree *)(map + l.trees);
+  for (int k=0; k<h->trees; k++) {
+    if (trees[k].var < 0 || trees[k].root < 0 || trees[k].root >= h->nodes
+        || nodes[trees[k].root].post != k || tree_of(trees[k].var) != NULL)
+      looming_doom("SNAPSHOT FORMAT");
+    int e = var_entry(trees[k].var, true);
+    if (e < 0)
+      looming_doom("SNAPSHOT TREES");
+    circuit.var_table[e].tree = circuit.variables[trees[k].root];
+    circuit.topo_ord[k] = trees[k].var;
+  }
+  if (x0_tree != ((tree_of(0) != NULL) ? tree_of(0)->post : -1))
+    looming_doom("SNAPSHOT FORMAT");
+  //parents are counted again and a node may wait only for trees before the ones it is in
+  int *parents = calloc(h->nodes + 1, sizeof(int));
+  int *waits = calloc(h->nodes + 1, sizeof(int)); //last tree in the order the node waits for
+  if (parents == NULL || waits == NULL)
+    looming_doom("SNAPSHOT NODES");
+  int roots = 0;
+  for (int i=0; i<h->nodes; i++) {
+    ParseTree t = circuit.variables[i];
+    ParseTree tree = (t->type == VAR) ? tree_of(t->label.var) : NULL;
+    waits[i] = (tree != NULL) ? tree->post : -1;
+    for (int j=0; j<2; j++) {
+      ParseTree child = (j == 0) ? t->left : t->right;
+      if (child != NULL) {
+        parents[child->id]++;
+        waits[i] = (waits[child->id] > waits[i]) ? waits[child->id] : waits[i];
       }
     }
-    else {
-      Mes message;
-      struct pollfd *entries = calloc(how_many_labeled_vars + 1, sizeof(struct pollfd));
-      ParseTree *node2write = calloc(how_many_labeled_vars + 1, sizeof(ParseTree));
-      entries[0].fd = circuit.trees[0]->parent_read_from_me;
-      entries[0].events = POLLIN;
-      node2write[0] = circuit.trees[0];
-      size_t entq = 1;
-      for (int i=0; i<circuit.list_len; i++) {
-        ParseTree node = circuit.variables[i];
-        if (node->type == VAR) {
-          entries[entq].fd = node->circuit_read_from_var;
-          entries[entq].events = POLLIN;
-          node2write[entq++] = node;
+    roots += t->is_root;
+    if (t->is_root && waits[i] >= t->post)
+      looming_doom("SNAPSHOT FORMAT");
+  }
+  for (int i=0; i<h->nodes; i++) {
+    if (parents[i] != circuit.variables[i]->parents)
+      looming_doom("SNAPSHOT FORMAT");
+  }
+  if (roots != h->trees)
+    looming_doom("SNAPSHOT FORMAT");
+  free(parents);
+  free(waits);
+}
+
+/* Reads, validates and sorts the equations printing their verdicts, the first equation
+   that fails ends the program */
+void read_equations() {
+  char *line;
+  for (int k=1; k<=K; k++) {
+    if (input_int(&nr) < 0 || (line = input_line()) == NULL)
+      break;
+    equations_hash = hash_line(equations_hash, nr, line);
+    char *mock_line = line;
+    Label label;
+    NodeType nodetype = retrieve_var(&mock_line, &label); //left side of equation
+    bool failed = (nodetype != VAR || label.var < 0 || tree_of(label.var) != NULL);
+    if (!failed) {
+      while (is_blank(*mock_line) || *mock_line == '=')
+        ++mock_line;
+      ParseTree tree = parse_line(&mock_line);
+      if (tree != NULL && (tree = simplify(tree)) != NULL)
+        tree = share_subtrees(tree);
+      if (tree == NULL)
+        looming_doom("PARSE ERR");
+      failed = (add_tree(label.var, tree) < 0);
+    }
+    if (failed) {
+      printf("%d F\n", nr);
+      if (options.save_snapshot != NULL)
+        save_snapshot(nr);
+      looming_doom(NULL);
+    }
+    printf("%d P\n", nr);
+    if (intlist_push(&verdicts, nr) < 0)
+      looming_doom("VERDICTS");
+  }
+  pack_order();
+  x0_tree = (tree_of(0) != NULL) ? tree_of(0)->post : -1;
+}
+
+void usage(char *prog) {
+  fprintf(stderr, "Usage: %s [--in-process] [--threads N] [--stream] [--window N] [--in-flight N]"
+      " [--pipes] [--snapshot FILE] [--save-snapshot FILE] [--max-procs N] [--trace FILE] [--bigint] [--delta]\n", prog);
+  exit(1);
+}
+
+void parse_options(int argc, char **argv) {
+  static struct option long_options[] = {
+    {"in-process", no_argument, NULL, 'i'},
+    {"threads", required_argument, NULL, 't'},
+    {"stream", no_argument, NULL, 's'},
+    {"window", required_argument, NULL, 'w'},
+    {"in-flight", required_argument, NULL, 'F'},
+    {"pipes", no_argument, NULL, 'p'},
+    {"snapshot", required_argument, NULL, 'L'},
+    {"save-snapshot", required_argument, NULL, 'S'},
+    {"max-procs", required_argument, NULL, 'm'},
+    {"trace", required_argument, NULL, 'T'},
+    {"bigint", no_argument, NULL, 'b'},
+    {"delta", no_argument, NULL, 'D'},
+    {NULL, 0, NULL, 0}
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "it:sw:F:pL:S:m:T:bD", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'i':
+        options.in_process = true;
+        break;
+      case 't': //threads are only used by in-process engine
+        options.threads = atoi(optarg);
+        options.in_process = true;
+        if (options.threads < 1)
+          usage(argv[0]);
+        break;
+      case 's':
+        options.stream = true;
+        break;
+      case 'p':
+        options.pipes = true;
+        break;
+      case 'L':
+        options.snapshot = optarg;
+        break;
+      case 'S':
+        options.save_snapshot = optarg;
+        break;
+      case 'm':
+        options.max_procs = atoi(optarg);
+        if (options.max_procs < 1)
+          usage(argv[0]);
+        break;
+      case 'T':
+        options.trace = optarg;
+        break;
+      case 'b':
+        options.bigint = true;
+        break;
+      case 'D':
+        options.delta = true;
+        options.in_process = true;
+        break;
+      case 'w':
+        options.window = atoi(optarg);
+        if (options.window < 1)
+          usage(argv[0]);
+        break;
+      case 'F':
+        options.in_flight = atoi(optarg);
+        if (options.in_flight < 1)
+          usage(argv[0]);
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (optind < argc || (options.snapshot != NULL && options.save_snapshot != NULL))
+    usage(argv[0]);
+}
+
+int main(int argc, char **argv) {
+  parse_options(argc, argv);
+  if (options.trace != NULL) {
+    if (trace_open(options.trace) < 0)
+      looming_doom("TRACE");
+    trace_name("circuit");
+  }
+  if (input_open(0) < 0 || input_int(&N) < 0 || input_int(&K) < 0 || input_int(&V) < 0)
+    looming_doom("INPUT");
+  if (init_circuit() == 0) {
+    if (options.snapshot != NULL)
+      load_snapshot();
+    else
+      read_equations();
+    if (options.save_snapshot != NULL)
+      save_snapshot(-1);
+    fflush(stdout);
+    size_t listened = 0;
+    if (!options.in_process)
+      listened = (options.max_procs > 0) ? spawn_units() : spawn_roots();
+    int batch = (options.stream && options.window < N-K) ? options.window : N-K;
+    while (init.lines < N-K) {
+      int count = (N-K - init.lines < batch) ? N-K - init.lines : batch;
+      TRACE('B', "read batch", 0);
+      read_init_lists(count);
+      TRACE('E', "read batch", 0);
+      TRACE('B', "batch", 0);
+      if (x0_tree < 0) {
+        for (int i=0; i<count; i++) {
+          printf("%d F\n", init.labels[i]);
         }
       }
-      int answers = 0;
-      for (int i=0; i<N-K; i++) {
-        if (vars[i*NODES_MAX] < INFINITY) { //not an infinity
-          printf("%d P %d\n", labels[i], vars[i*1000]);
-          ++answers;
+      else if (options.delta) {
+        run_delta(count);
+      }
+      else if (options.in_process) {
+        run_in_process(count);
+      }
+      else {
+        dispatch_queries(listened, count);
+      }
+      TRACE('E', "batch", 0);
+      fflush(stdout);
+    }
+    if (!options.in_process) {
+      size_t forked = (options.max_procs > 0) ? units.procs_len : circuit.tops_len;
+      for (int t=0; t<forked; t++) {
+        if (options.max_procs > 0) { //units may still ask for what nobody waits for anymore
+          close(units.procs[t].circuit_write);
+          close(units.procs[t].circuit_read);
         }
         else {
-          send_message(node2write[0]->parent_write_to_me, i, -1, false);
+          close(circuit.tops[t]->io->parent_write_to_me);
         }
       }
-      int ret;
-      bool finish = false;
-      while (answers < N-K && !finish) {  
-        for (int i=0; i<how_many_labeled_vars + 1; i++)
-          entries[i].revents = 0;
-        ret = poll(entries, how_many_labeled_vars + 1, -1);
-        if ((ret) < 0) {
-          looming_doom ("POLL READ CIRC");
-        }
-        else if (ret > 0) {
-          for (int i=0; i<how_many_labeled_vars + 1; i++) {
-            if (entries[i].revents & POLLHUP) {
-              finish = true; //pipe is closed
-            }
-            if (entries[i].revents & (POLLIN | POLLERR)) {
-              if ((len = read(entries[i].fd, &message, sizeof(message))) == -1)
-                looming_doom("READ IN CIRC");
-              if (len == 0) {
-                finish = true;
-              }
-              else {
-                if (i == 0) {
-                  if (message.err)
-                    printf("%d F\n", labels[message.i]);
-                  else
-                    printf("%d P %ld\n", labels[message.i], message.val);
-                  answers++;
-                }
-                else {
-                  long var = vars[message.i*NODES_MAX + node2write[i]->label.var];
-                  if (var < INFINITY) { //not an infinity
-                    send_message(node2write[i]->circuit_write_to_var, message.i, var, false);
-                  }
-                  else {
-                    send_message(node2write[i]->circuit_write_to_var, message.i, 0, true);
-                  }
-                }
-              }
-            }
-          }
-        }
+      // Wait for tops or processes of units
+      for (int i=0; i<forked; i++) {
+        if (wait(0) == -1)
+          looming_doom("WAIT ERR");
       }
-      free(node2write);
-      free(entries);
-    }
-    free(labels);
-    free(vars);
-    for (int v=0; v<NODES_MAX; v++) {
-      if (circuit.trees[v] != NULL)
-        close(circuit.trees[v]->parent_write_to_me);
-    }
-    // Wait for roots
-    for (int i=0; i<circuit.topo_ord_len; i++) {
-      if (wait(0) == -1)
-        looming_doom("WAIT ERR");
     }
   }
   looming_doom(NULL);
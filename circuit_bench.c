@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+#include "err.h"
+#include "gen.h"
+
+/* Runs circuit on a generated input and prints a single line of JSON:
+   wall time is the best of --runs plain runs, peak RSS the largest of them,
+   syscalls and processes come from one extra run traced with ptrace. Keys are always
+   printed in the same order, so lines can be compared across commits. Input throughput
+   covers the whole run, so it is meaningful for inputs made of few huge equations. */
+
+struct Options {
+  int runs;
+  bool trace;
+  char *circuit;
+  char **args; //passed to circuit, NULL terminated with circuit in args[0]
+} options = {3, true, NULL, NULL};
+
+struct Result {
+  double wall; //seconds
+  long peak_rss; //KB, the largest process of the tree
+  long syscalls;
+  long processes; //circuit itself included
+  int status;
+} result = {0, 0, -1, -1, 0};
+
+void usage(char *prog) {
+  fprintf(stderr, "Usage: %s " GEN_USAGE " [--runs R] [--no-trace] [--circuit PATH]"
+      " [-- CIRCUIT_ARGS...]\n", prog);
+  exit(1);
+}
+
+/* circuit binary next to this one unless given */
+char *default_circuit() {
+  static char path[PATH_MAX];
+  ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - sizeof("/circuit"));
+  if (len < 0)
+    return "./circuit";
+  path[len] = '\0';
+  strcat(dirname(path), "/circuit");
+  return path;
+}
+
+/* Forks circuit reading [input], output goes to /dev/null */
+pid_t start_circuit(int input, bool traced) {
+  pid_t pid = fork();
+  if (pid < 0)
+    syserr("fork");
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null < 0 || lseek(input, 0, SEEK_SET) < 0 || dup2(input, 0) < 0 || dup2(null, 1) < 0)
+      syserr("child setup");
+    if (traced) {
+      if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+        syserr("ptrace traceme");
+      raise(SIGSTOP);
+    }
+    execv(options.circuit, options.args);
+    syserr("exec %s", options.circuit);
+  }
+  return pid;
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void timed_run(int input) {
+  double start = now();
+  pid_t pid = start_circuit(input, false);
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0)
+    syserr("wait4");
+  double wall = now() - start;
+  if (result.wall == 0 || wall < result.wall)
+    result.wall = wall;
+  if (usage.ru_maxrss > result.peak_rss)
+    result.peak_rss = usage.ru_maxrss;
+  result.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* Follows the whole tree of processes counting syscall entries and forks */
+void traced_run(int input) {
+  pid_t pid = start_circuit(input, true);
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+    syserr("traced start");
+  long opts = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK
+      | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL;
+  if (ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)opts) < 0)
+    syserr("ptrace setoptions");
+  result.syscalls = 0;
+  result.processes = 1;
+  ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+  pid_t tracee;
+  while ((tracee = waitpid(-1, &status, __WALL)) > 0) {
+    if (!WIFSTOPPED(status))
+      continue;
+    int sig = 0;
+    int event = status >> 16;
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+      struct __ptrace_syscall_info info;
+      if (ptrace(PTRACE_GET_SYSCALL_INFO, tracee, (void *)sizeof(info), &info) > 0
+          && info.op == PTRACE_SYSCALL_INFO_ENTRY)
+        result.syscalls++;
+    }
+    else if (event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK) {
+      result.processes++;
+    }
+    else if (event == 0 && WSTOPSIG(status) != SIGSTOP) {
+      sig = WSTOPSIG(status); //a real signal, not a stop of a fresh tracee
+    }
+    ptrace(PTRACE_SYSCALL, tracee, NULL, (void *)(long)sig);
+  }
+}
+
+int main(int argc, char **argv) {
+  static struct option long_options[] = {
+    GEN_LONG_OPTIONS,
+    {"runs", required_argument, NULL, 'r'},
+    {"no-trace", no_argument, NULL, 'n'},
+    {"circuit", required_argument, NULL, 'x'},
+    {NULL, 0, NULL, 0}
+  };
+  struct GenParams params = GEN_DEFAULTS;
+  int c;
+  while ((c = getopt_long(argc, argv, GEN_SHORT_OPTIONS "r:nx:", long_options, NULL)) != -1) {
+    switch (c) {
+      case 'r':
+        options.runs = atoi(optarg);
+        if (options.runs < 1)
+          usage(argv[0]);
+        break;
+      case 'n':
+        options.trace = false;
+        break;
+      case 'x':
+        options.circuit = optarg;
+        break;
+      default:
+        if (gen_option(&params, c, optarg) < 0)
+          usage(argv[0]);
+    }
+  }
+  if (options.circuit == NULL)
+    options.circuit = default_circuit();
+  // argv[optind-1] becomes args[0], its content does not matter
+  options.args = argv + optind - 1;
+  options.args[0] = options.circuit;
+
+  FILE *input = tmpfile();
+  if (input == NULL)
+    syserr("tmpfile");
+  if (generate(input, &params) < 0 || fflush(input) != 0)
+    syserr("generate");
+  long input_bytes = ftell(input);
+  for (int r=0; r<options.runs; r++)
+    timed_run(fileno(input));
+  if (options.trace)
+    traced_run(fileno(input));
+  fclose(input);
+
+  printf("{");
+  gen_print_params(stdout, &params);
+  printf(", \"args\": \"");
+  for (int a=1; options.args[a] != NULL; a++)
+    printf("%s%s", (a > 1) ? " " : "", options.args[a]);
+  printf("\", \"runs\": %d, \"status\": %d, \"wall_s\": %.6f, \"peak_rss_kb\": %ld",
+      options.runs, result.status, result.wall, result.peak_rss);
+  if (options.trace)
+    printf(", \"syscalls\": %ld, \"processes\": %ld", result.syscalls, result.processes);
+  else
+    printf(", \"syscalls\": null, \"processes\": null");
+  printf(", \"qps\": %.1f", (result.wall > 0) ? params.queries / result.wall : 0.0);
+  printf(", \"input_bytes\": %ld, \"input_mb_s\": %.2f}\n", input_bytes,
+      (result.wall > 0) ? input_bytes / result.wall / 1e6 : 0.0);
+  return 0;
+}
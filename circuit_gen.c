@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "gen.h"
+
+/* Writes a synthetic circuit input to the standard output */
+
+void usage(char *prog) {
+  fprintf(stderr, "Usage: %s " GEN_USAGE "\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  static struct option long_options[] = {
+    GEN_LONG_OPTIONS,
+    {NULL, 0, NULL, 0}
+  };
+  struct GenParams params = GEN_DEFAULTS;
+  int c;
+  while ((c = getopt_long(argc, argv, GEN_SHORT_OPTIONS, long_options, NULL)) != -1) {
+    if (gen_option(&params, c, optarg) < 0)
+      usage(argv[0]);
+  }
+  if (optind < argc)
+    usage(argv[0]);
+  return (generate(stdout, &params) < 0) ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include "gen.h"
+
+/* xorshift64*, so that inputs do not depend on the libc rand() */
+static unsigned long long state;
+
+static unsigned long long next_random() {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 2685821657736338717ull;
+}
+
+static int uniform(int n) {
+  return (int)(next_random() % (unsigned long long)n);
+}
+
+static double chance() {
+  return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int gen_option(struct GenParams *p, int c, const char *arg) {
+  switch (c) {
+    case 'k':
+      p->equations = atoi(arg);
+      return (p->equations < 1) ? -1 : 0;
+    case 'd':
+      p->depth = atoi(arg);
+      return (p->depth < 1) ? -1 : 0;
+    case 'w':
+      p->width = atoi(arg);
+      return (p->width < 1) ? -1 : 0;
+    case 'f':
+      p->fanout = atoi(arg);
+      return (p->fanout < 1) ? -1 : 0;
+    case 'c':
+      p->cross = atof(arg);
+      return (p->cross < 0 || p->cross > 1) ? -1 : 0;
+    case 'l':
+      p->chain = true;
+      return 0;
+    case 'q':
+      p->queries = atoi(arg);
+      return (p->queries < 0) ? -1 : 0;
+    case 'm':
+      p->missing = atof(arg);
+      return (p->missing < 0 || p->missing > 1) ? -1 : 0;
+    case 's':
+      p->seed = strtoul(arg, NULL, 10);
+      return 0;
+  }
+  return -1;
+}
+
+void gen_print_params(FILE *out, const struct GenParams *p) {
+  fprintf(out, "\"equations\": %d, \"depth\": %d, \"width\": %d, \"fanout\": %d, "
+      "\"cross\": %.3f, \"chain\": %s, \"queries\": %d, \"missing\": %.3f, \"seed\": %lu",
+      p->equations, p->depth, p->width, p->fanout, p->cross, p->chain ? "true" : "false",
+      p->queries, p->missing, p->seed);
+}
+
+/* Number of free variables, so that each is referenced about fanout times */
+static int free_vars(const struct GenParams *p) {
+  long leaves = (long)p->equations * p->depth * p->width;
+  long free = leaves / p->fanout;
+  return (free < 1) ? 1 : (int)free;
+}
+
+/* Leaf of equation of x[eq]: reference to a later equation, a free variable or a numeral */
+static void leaf(FILE *out, const struct GenParams *p, int eq) {
+  if (eq + 1 < p->equations && chance() < p->cross)
+    fprintf(out, "x[%d]", eq + 1 + (p->chain ? 0 : uniform(p->equations - eq - 1)));
+  else if (uniform(8) == 0)
+    fprintf(out, "%d", uniform(10));
+  else
+    fprintf(out, "x[%d]", p->equations + uniform(free_vars(p)));
+}
+
+/* Balanced subtree with [leaves] leaves, depth is logarithmic so recursion is fine */
+static void subtree(FILE *out, const struct GenParams *p, int eq, int leaves) {
+  if (leaves == 1) {
+    leaf(out, p, eq);
+    return;
+  }
+  bool negate = (uniform(8) == 0);
+  if (negate)
+    fprintf(out, "(- ");
+  fprintf(out, "(");
+  subtree(out, p, eq, leaves / 2);
+  fprintf(out, (uniform(4) == 0) ? " * " : " + ");
+  subtree(out, p, eq, leaves - leaves / 2);
+  fprintf(out, ")");
+  if (negate)
+    fprintf(out, ")");
+}
+
+int generate(FILE *out, const struct GenParams *p) {
+  state = p->seed * 0x9E3779B97F4A7C15ull + 1;
+  int V = p->equations + free_vars(p);
+  fprintf(out, "%d %d %d\n", p->equations + p->queries, p->equations, V);
+  int nr = 1;
+  for (int eq=0; eq<p->equations; eq++) {
+    // chain comes in its natural order, every equation using the one that follows
+    fprintf(out, "%d x[%d] = ", nr++, eq);
+    // chain ((S1 op S2) op S3)... written without recursion, so depth may be large
+    for (int l=1; l<p->depth; l++)
+      fprintf(out, "(");
+    subtree(out, p, eq, p->width);
+    for (int l=1; l<p->depth; l++) {
+      fprintf(out, (uniform(4) == 0) ? " * " : " + ");
+      subtree(out, p, eq, p->width);
+      fprintf(out, ")");
+    }
+    fprintf(out, "\n");
+  }
+  for (int q=0; q<p->queries; q++) {
+    fprintf(out, "%d", nr++);
+    int left_out = (chance() < p->missing) ? p->equations + uniform(V - p->equations) : -1;
+    for (int v=p->equations; v<V; v++) {
+      if (v != left_out)
+        fprintf(out, " x[%d] %d", v, uniform(10));
+    }
+    fprintf(out, "\n");
+  }
+  return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,49 @@
+#ifndef _GEN_
+#define _GEN_
+
+#include <stdio.h>
+#include <stdbool.h>
+
+/* Shape of a synthetic circuit in the N K V input format. Equations define x[0..K-1],
+   equation of x[i] may only refer to x[j] for j > i so the circuit is acyclic, the rest
+   of the variables are free and given by init lists. */
+struct GenParams {
+  int equations; //K
+  int depth; //levels of the chain every equation is made of
+  int width; //leaves of the balanced subtree hanging off every level
+  int fanout; //average number of references to a single free variable
+  double cross; //probability that a leaf refers to another equation
+  bool chain; //whether such leaf refers to the next equation, so equations form one long chain
+  int queries; //init lists
+  double missing; //fraction of init lists leaving one of the free variables out
+  unsigned long seed;
+};
+
+#define GEN_DEFAULTS {16, 8, 4, 4, 0.1, false, 1000, 0.1, 1}
+
+/* Options understood by gen_option, to be pasted into getopt_long tables */
+#define GEN_LONG_OPTIONS \
+  {"equations", required_argument, NULL, 'k'}, \
+  {"depth", required_argument, NULL, 'd'}, \
+  {"width", required_argument, NULL, 'w'}, \
+  {"fanout", required_argument, NULL, 'f'}, \
+  {"cross", required_argument, NULL, 'c'}, \
+  {"chain", no_argument, NULL, 'l'}, \
+  {"queries", required_argument, NULL, 'q'}, \
+  {"missing", required_argument, NULL, 'm'}, \
+  {"seed", required_argument, NULL, 's'}
+#define GEN_SHORT_OPTIONS "k:d:w:f:c:lq:m:s:"
+#define GEN_USAGE "[--equations K] [--depth D] [--width W] [--fanout F] [--cross P] " \
+  "[--chain] [--queries Q] [--missing P] [--seed S]"
+
+/* Applies option [c] with argument [arg], returns -1 if it is not a generator option
+   or its argument is out of range */
+extern int gen_option(struct GenParams *p, int c, const char *arg);
+
+/* Prints params as members of a JSON object */
+extern void gen_print_params(FILE *out, const struct GenParams *p);
+
+/* Writes the whole input described by [p], the same params always give the same input */
+extern int generate(FILE *out, const struct GenParams *p);
+
+#endif
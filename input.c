@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "input.h"
+
+#define INPUT_CHUNK (1 << 16)
+
+static struct Input {
+  int fd;
+  char *buf; //one byte longer than cap, so that the last line can always get its '\n'
+  size_t pos; //start of the current line
+  size_t len;
+  size_t cap;
+  size_t seen; //no '\n' between pos and seen
+  size_t size; //of the mapping
+  bool mapped;
+  bool eof;
+} input = {-1};
+
+int input_open(int fd) {
+  struct stat st;
+  input.fd = fd;
+  off_t off = lseek(fd, 0, SEEK_CUR);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && off >= 0 && st.st_size > off) {
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // without '\n' at the end the last line would run off the mapping
+    if (map != MAP_FAILED && map[st.st_size - 1] == '\n') {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      input.buf = map;
+      input.pos = off;
+      input.len = input.size = st.st_size;
+      input.mapped = true;
+      return 0;
+    }
+    if (map != MAP_FAILED)
+      munmap(map, st.st_size);
+  }
+  input.cap = INPUT_CHUNK;
+  input.buf = malloc(input.cap + 1);
+  return (input.buf == NULL) ? -1 : 0;
+}
+
+void input_close() {
+  if (input.mapped)
+    munmap(input.buf, input.size);
+  else
+    free(input.buf);
+  input = (struct Input) {-1};
+}
+
+/* Makes sure the line at input.pos is whole in the buffer, returns false at the end of input */
+static bool whole_line() {
+  if (input.mapped)
+    return input.pos < input.len;
+  while (true) {
+    size_t from = (input.seen > input.pos) ? input.seen : input.pos;
+    if (memchr(input.buf + from, '\n', input.len - from) != NULL)
+      return true;
+    input.seen = input.len;
+    if (input.eof) {
+      if (input.pos == input.len)
+        return false;
+      input.buf[input.len++] = '\n';
+      return true;
+    }
+    if (input.pos > 0) {
+      memmove(input.buf, input.buf + input.pos, input.len - input.pos);
+      input.len -= input.pos;
+      input.seen -= input.pos;
+      input.pos = 0;
+    }
+    if (input.len == input.cap) { //line longer than the buffer
+      char *nbuf = realloc(input.buf, 2*input.cap + 1);
+      if (nbuf == NULL)
+        return false;
+      input.buf = nbuf;
+      input.cap *= 2;
+    }
+    ssize_t r = read(input.fd, input.buf + input.len, input.cap - input.len);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      input.eof = true;
+    else
+      input.len += r;
+  }
+}
+
+int input_int(int *n) {
+  while (whole_line()) {
+    char *p = input.buf + input.pos;
+    while (is_blank(*p))
+      p++;
+    input.pos = p - input.buf;
+    if (*p == '\n') {
+      input.pos++;
+      continue;
+    }
+    bool found = scan_int(&p, n);
+    input.pos = p - input.buf;
+    return found ? 0 : -1;
+  }
+  return -1;
+}
+
+char *input_line() {
+  if (!whole_line())
+    return NULL;
+  char *line = input.buf + input.pos;
+  input.pos = (char *) memchr(line, '\n', input.len - input.pos) + 1 - input.buf;
+  return line;
+}
+
+char *input_skip_line(char c) {
+  if (!whole_line())
+    return NULL;
+  char *p = input.buf + input.pos;
+  for (; *p != '\n'; p++) {
+    if (*p == c)
+      return input_line();
+  }
+  return NULL;
+}
+
+bool scan_int(char **p, int *n) {
+  char *s = *p;
+  bool minus = (*s == '-');
+  if (minus)
+    s++;
+  if (*s < '0' || *s > '9')
+    return false;
+  long v = 0;
+  for (; *s >= '0' && *s <= '9'; s++) {
+    if (v <= INT_MAX)
+      v = 10*v + (*s - '0');
+  }
+  if (v > INT_MAX)
+    v = INT_MAX;
+  *n = minus ? -v : v;
+  *p = s;
+  return true;
+}
+
+char scan_token(char **p, int *value) {
+  char *s = *p;
+  while (is_blank(*s))
+    s++;
+  *p = s;
+  if (s[0] == 'x' && s[1] == '[') {
+    s += 2;
+    while (is_blank(*s))
+      s++;
+    if (!scan_int(&s, value))
+      *value = 0;
+    while (*s != '\n' && *s++ != ']');
+    *p = s;
+    return 'x';
+  }
+  if (*s >= '0' && *s <= '9') {
+    scan_int(p, value);
+    return '0';
+  }
+  if (*s == '+' || *s == '*' || *s == '-') {
+    *p = s + 1;
+    return *s;
+  }
+  return '\0';
+}
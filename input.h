@@ -0,0 +1,36 @@
+#ifndef _INPUT_
+#define _INPUT_
+
+#include <stdbool.h>
+
+/* Reads input one line at a time, lines handed out always end with '\n' and stay valid
+   until the next read. Regular files are mapped whole, anything else goes through
+   a buffer refilled with read. */
+extern int input_open(int fd);
+extern void input_close();
+
+/* Reads an integer that may be preceded by blanks and empty lines, returns -1 at the end
+   of input or if there is no integer */
+extern int input_int(int *n);
+
+/* Returns the rest of the current line and moves to the next one, NULL at the end of input */
+extern char *input_line();
+
+/* Skips the current line if it contains [c] and returns it, NULL if it was not skipped */
+extern char *input_skip_line(char c);
+
+/* Blanks separating tokens within a line */
+static inline bool is_blank(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Scans an integer with an optional minus at [*p], returns false if there are no digits.
+   Values too large for an int are saturated. */
+extern bool scan_int(char **p, int *n);
+
+/* Scans the next token of a line at [*p] skipping blanks before it: returns 'x' for variable
+   x[value], '0' for numeral, the character of operators +, * and -, or '\0' for anything
+   else, in which case [*p] is left at that character. */
+extern char scan_token(char **p, int *value);
+
+#endif
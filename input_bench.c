@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "err.h"
+#include "gen.h"
+#include "input.h"
+
+/* Tokenizes a generated input the way circuit used to, with scanf, getline, isspace and
+   atoi, and with the input reader, both on a mapped file and on a pipe. Prints a single line
+   of JSON with MB/s of each, best of --runs. Token counts and checksums of all of them are
+   printed too, they have to agree. */
+
+struct Pass {
+  double wall;
+  long tokens;
+  long sum; //of all the integers met
+};
+
+void usage(char *prog) {
+  fprintf(stderr, "Usage: %s " GEN_USAGE " [--runs R]\n", prog);
+  exit(1);
+}
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Token scanner circuit had before the input reader, returns its token like scan_token */
+char legacy_token(char **line, int *value) {
+  while (**line != '\0' && isspace(**line)) {
+    ++(*line);
+  }
+  if (**line == 'x' && *(*line + 1) == '[') {
+    *line += 2;
+    *value = atoi(*line);
+    while (**line != '\0' && *((*line)++) != ']');
+    return 'x';
+  }
+  if (isdigit(**line)) {
+    *value = atoi(*line);
+    while (isdigit(*(++(*line))));
+    return '0';
+  }
+  if (**line == '+' || **line == '*' || **line == '-')
+    return *((*line)++);
+  return '\0';
+}
+
+void count(struct Pass *pass, int value) {
+  pass->tokens++;
+  pass->sum += value;
+}
+
+void legacy_pass(FILE *in, struct Pass *pass) {
+  int n, k, v, nr;
+  char *line = NULL;
+  size_t len = 0;
+  if (fscanf(in, "%d%d%d", &n, &k, &v) != 3)
+    fatal("header");
+  count(pass, n + k + v);
+  while (fscanf(in, "%d", &nr) == 1 && getline(&line, &len, in) >= 0) {
+    count(pass, nr);
+    char *p = line;
+    while (*p != '\0') {
+      int value = 0;
+      char c = legacy_token(&p, &value);
+      if (c == '\0' && *p != '\0')
+        ++p; //parentheses and '='
+      else if (c != '\0')
+        count(pass, value);
+    }
+  }
+  free(line);
+}
+
+void reader_pass(int fd, struct Pass *pass) {
+  int n, k, v, nr;
+  char *line;
+  if (input_open(fd) < 0 || input_int(&n) < 0 || input_int(&k) < 0 || input_int(&v) < 0)
+    fatal("header");
+  count(pass, n + k + v);
+  while (input_int(&nr) == 0 && (line = input_line()) != NULL) {
+    count(pass, nr);
+    char *p = line;
+    while (*p != '\n') {
+      int value = 0;
+      char c = scan_token(&p, &value);
+      if (c == '\0' && *p != '\n')
+        ++p;
+      else if (c != '\0')
+        count(pass, value);
+    }
+  }
+  input_close();
+}
+
+/* Feeds the file to a pipe from a child, so that the reader can not map it */
+int pipe_from(FILE *file) {
+  int fds[2];
+  if (pipe(fds) < 0)
+    syserr("pipe");
+  switch (fork()) {
+    case -1:
+      syserr("fork");
+    case 0: {
+      close(fds[0]);
+      char buf[1 << 16];
+      size_t r;
+      rewind(file);
+      while ((r = fread(buf, 1, sizeof(buf), file)) > 0) {
+        if (write(fds[1], buf, r) != (ssize_t) r)
+          syserr("write");
+      }
+      exit(0);
+    }
+  }
+  close(fds[1]);
+  return fds[0];
+}
+
+/* Runs pass [kind] over [file] and keeps its best time in [best] */
+void timed_pass(FILE *file, char kind, struct Pass *best) {
+  struct Pass pass = {0};
+  rewind(file);
+  int fd = (kind == 'p') ? pipe_from(file) : fileno(file);
+  if (kind != 'p' && lseek(fd, 0, SEEK_SET) < 0)
+    syserr("lseek");
+  double start = now();
+  if (kind == 'l')
+    legacy_pass(file, &pass);
+  else
+    reader_pass(fd, &pass);
+  pass.wall = now() - start;
+  if (kind == 'p') {
+    close(fd);
+    wait(NULL);
+  }
+  if (best->wall == 0 || pass.wall < best->wall)
+    *best = pass;
+}
+
+int main(int argc, char **argv) {
+  static struct option long_options[] = {
+    GEN_LONG_OPTIONS,
+    {"runs", required_argument, NULL, 'r'},
+    {NULL, 0, NULL, 0}
+  };
+  struct GenParams params = GEN_DEFAULTS;
+  int runs = 3;
+  int c;
+  while ((c = getopt_long(argc, argv, GEN_SHORT_OPTIONS "r:", long_options, NULL)) != -1) {
+    if (c == 'r') {
+      if ((runs = atoi(optarg)) < 1)
+        usage(argv[0]);
+    }
+    else if (gen_option(&params, c, optarg) < 0) {
+      usage(argv[0]);
+    }
+  }
+  if (optind < argc)
+    usage(argv[0]);
+
+  FILE *file = tmpfile();
+  if (file == NULL)
+    syserr("tmpfile");
+  if (generate(file, &params) < 0 || fflush(file) != 0)
+    syserr("generate");
+  long bytes = ftell(file);
+  struct Pass legacy = {0}, mapped = {0}, piped = {0};
+  for (int r=0; r<runs; r++) {
+    timed_pass(file, 'l', &legacy);
+    timed_pass(file, 'm', &mapped);
+    timed_pass(file, 'p', &piped);
+  }
+  fclose(file);
+
+  printf("{");
+  gen_print_params(stdout, &params);
+  printf(", \"runs\": %d, \"input_bytes\": %ld", runs, bytes);
+  struct Pass *passes[] = {&legacy, &mapped, &piped};
+  const char *names[] = {"scanf", "mmap", "read"};
+  for (int p=0; p<3; p++) {
+    printf(", \"%s_tokens\": %ld, \"%s_sum\": %ld, \"%s_mb_s\": %.2f", names[p], passes[p]->tokens,
+        names[p], passes[p]->sum, names[p], (passes[p]->wall > 0) ? bytes / passes[p]->wall / 1e6 : 0.0);
+  }
+  printf("}\n");
+  return (legacy.tokens == mapped.tokens && legacy.sum == mapped.sum
+      && legacy.tokens == piped.tokens && legacy.sum == piped.sum) ? 0 : 1;
+}
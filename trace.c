@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "trace.h"
+
+#define TRACE_EVENTS_CAP (1 << 20) //per process, the ones after it are only counted
+#define TRACE_QUERY_SAMPLE 64
+
+typedef struct {
+  uint64_t ts; //microseconds
+  const char *name;
+  int id;
+  char ph;
+} TraceEvent;
+
+struct Counters counters;
+bool tracing;
+
+static struct {
+  int fd;
+  pid_t owner; //process that opened the file, it writes the last part
+  bool root; //this is the owner, forked processes are not
+  char name[64];
+  TraceEvent *events;
+  size_t len;
+  size_t cap;
+  long dropped;
+} trace = {-1};
+
+static uint64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int trace_open(const char *path) {
+  trace.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (trace.fd < 0)
+    return -1;
+  trace.owner = getpid();
+  trace.root = true;
+  tracing = true;
+  //every other event is written with a comma before it
+  dprintf(trace.fd, "[\n{\"name\": \"trace\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"ts\": %llu}",
+      trace.owner, trace.owner, (unsigned long long) now_us());
+  return 0;
+}
+
+void trace_child() {
+  counters = (struct Counters) {0};
+  trace.root = false;
+  trace.len = 0;
+  trace.dropped = 0;
+}
+
+void trace_name(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(trace.name, sizeof(trace.name), fmt, args);
+  va_end(args);
+}
+
+void trace_event(char ph, const char *name, int id) {
+  if (ph == 'b')
+    counters.spans++;
+  if ((ph == 'b' || ph == 'e') && (!trace.root || id % TRACE_QUERY_SAMPLE != 0))
+    return;
+  if (trace.len == trace.cap) {
+    size_t nsize = (trace.cap == 0) ? 1024 : 2*trace.cap;
+    TraceEvent *nevents = (nsize <= TRACE_EVENTS_CAP) ? realloc(trace.events, sizeof(*nevents) * nsize) : NULL;
+    if (nevents == NULL) {
+      trace.dropped++;
+      return;
+    }
+    trace.events = nevents;
+    trace.cap = nsize;
+  }
+  trace.events[trace.len++] = (TraceEvent) {now_us(), name, id, ph};
+}
+
+/* Appends [len] bytes of [buf] at once, so that parts of processes do not interleave */
+static void append(char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(trace.fd, buf, len);
+    if (written <= 0)
+      return;
+    buf += written;
+    len -= written;
+  }
+}
+
+void trace_dump() {
+  if (!tracing)
+    return;
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *part = open_memstream(&buf, &size);
+  if (part == NULL)
+    return;
+  pid_t pid = getpid();
+  fprintf(part, ",\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+      "\"args\": {\"name\": \"%s\"}}", pid, pid, trace.name);
+  for (size_t j=0; j<trace.len; j++) {
+    TraceEvent *ev = &trace.events[j];
+    fprintf(part, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"%c\", \"ts\": %llu, "
+        "\"pid\": %d, \"tid\": %d", ev->name, (ev->ph == 'b' || ev->ph == 'e') ? "query" : "process",
+        ev->ph, (unsigned long long) ev->ts, pid, pid);
+    if (ev->ph == 'b' || ev->ph == 'e') //async spans are matched by id, so it carries the process
+      fprintf(part, ", \"id\": \"%d.%d\", \"args\": {\"query\": %d}", pid, ev->id, ev->id);
+    fprintf(part, "}");
+  }
+  fprintf(part, ",\n{\"name\": \"counters\", \"ph\": \"C\", \"ts\": %llu, \"pid\": %d, \"tid\": %d, "
+      "\"args\": {\"sent\": %ld, \"received\": %ld, \"bytes_written\": %ld, \"bytes_read\": %ld, "
+      "\"wakeups\": %ld, \"sleeps\": %ld, \"cache_hits\": %ld, \"replies\": %ld, \"spans\": %ld, "
+      "\"dropped_events\": %ld}}", (unsigned long long) now_us(), pid, pid, counters.sent,
+      counters.received, counters.bytes_written, counters.bytes_read, counters.wakeups,
+      counters.sleeps, counters.cache_hits, counters.replies, counters.spans, trace.dropped);
+  if (pid == trace.owner)
+    fprintf(part, "\n]\n");
+  fclose(part);
+  append(buf, size);
+  free(buf);
+  free(trace.events);
+  trace.events = NULL;
+  trace.len = trace.cap = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef _TRACE_
+#define _TRACE_
+
+#include <stdbool.h>
+
+/* Counters every process keeps, they are cheap enough to be always on */
+struct Counters {
+  long sent; //messages
+  long received;
+  long bytes_written; //to pipes or rings
+  long bytes_read;
+  long wakeups; //waits for the event loop that returned something
+  long sleeps; //waits that had to block
+  long cache_hits; //queries answered from the cache or joined to the one in flight
+  long replies; //answers sent by tops to their askers
+  long spans; //spans of queries begun, only a sample of the circuit's ones become events
+};
+
+extern struct Counters counters;
+extern bool tracing;
+
+/* Trace events of one process, they are written at its exit with the counters to the file
+   opened by trace_open. All the processes append to the same file, the one that called
+   trace_open ends it when it exits as the last one, so the file is a Chrome trace. */
+extern int trace_open(const char *path);
+
+/* Forgets what was inherited from the parent, called by a freshly forked process */
+extern void trace_child();
+
+/* Names the process in the trace */
+extern void trace_name(const char *fmt, ...);
+
+/* Records event of phase [ph] in Chrome trace terms: 'b' and 'e' begin and end span of
+   query [id], 'B' and 'E' a span of the process itself. Every process sees every query,
+   so spans are only counted, except for every 64th query in the circuit. */
+extern void trace_event(char ph, const char *name, int id);
+
+#define TRACE(ph, name, id) do { if (tracing) trace_event(ph, name, id); } while (0)
+
+/* Writes events and counters of the process, nothing if tracing is off */
+extern void trace_dump();
+
+#endif